@@ -0,0 +1,300 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Sequence a song, and the same song written by the optimizing writer and
+// read back, and check that the two performances are the same. The control
+// and program changes, which the writer can drop, are compared by their
+// effect on the state of the receiver. The events of different tracks at
+// the same time are compared regardless of order. Without a file, the
+// built-in songs are checked.
+
+#include "common.h"
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+
+struct channel_state {
+    int controls[128];
+    int program;
+    int bank;  // bank selected at the program change
+    int nrpn;  // whether data entry goes to NRPN rather than RPN
+};
+
+// -1 is a value unknown after a reset
+static void reset_channel(channel_state &ch)
+{
+    std::fill_n(ch.controls, 128, -1);
+    ch.program = -1;
+    ch.bank = -1;
+    ch.nrpn = -1;
+}
+
+static bool is_reset_sysex(const uint8_t *msg, uint32_t len)
+{
+    // GM system on, GM2 system on
+    if (len >= 6 && msg[1] == 0x7e && msg[3] == 0x09 &&
+        (msg[4] == 0x01 || msg[4] == 0x03))
+        return true;
+    // GS reset
+    if (len >= 11 && msg[1] == 0x41 && msg[3] == 0x42 && msg[4] == 0x12 &&
+        msg[5] == 0x40 && msg[6] == 0x00 && msg[7] == 0x7f)
+        return true;
+    // XG system on
+    if (len >= 9 && msg[1] == 0x43 && (msg[2] & 0xf0) == 0x10 &&
+        msg[3] == 0x4c && msg[4] == 0x00 && msg[5] == 0x00 && msg[6] == 0x7e)
+        return true;
+    return false;
+}
+
+// whether the event is omitted by the writer when it has no contents
+static bool is_empty(const fmidi_event_t *evt)
+{
+    switch (evt->type) {
+    case fmidi_event_meta: {
+        uint8_t tag = evt->data[0];
+        return evt->datalen == 1 && ((tag >= 0x01 && tag <= 0x0f) || tag == 0x7f);
+    }
+    case fmidi_event_message:
+        return evt->data[0] == 0xf0 && evt->datalen == 2;
+    case fmidi_event_escape:
+        return evt->datalen == 0;
+    default:
+        return true;  // XMI events, not written to SMF
+    }
+}
+
+// apply the event to the state of the receiver, and return whether the
+// event is performed otherwise
+static bool perform(const fmidi_event_t *evt, channel_state *state)
+{
+    if (is_empty(evt))
+        return false;
+    if (evt->type != fmidi_event_message)
+        return true;
+
+    const uint8_t *data = evt->data;
+    if (data[0] == 0xf0) {
+        if (is_reset_sysex(data, evt->datalen)) {
+            for (unsigned i = 0; i < 16; ++i)
+                reset_channel(state[i]);
+        }
+        return true;
+    }
+
+    channel_state &ch = state[data[0] & 15];
+    switch (data[0] >> 4) {
+    case 0xb: {
+        if (evt->datalen < 3)
+            return true;
+        unsigned ctl = data[1];
+        if (ctl == 6 || ctl == 38 || ctl == 96 || ctl == 97)
+            return true;
+        if (ctl >= 120) {
+            reset_channel(ch);
+            return true;
+        }
+        ch.controls[ctl] = data[2];
+        if (ctl >= 98 && ctl <= 101)
+            ch.nrpn = ctl < 100;
+        return false;
+    }
+    case 0xc:
+        if (evt->datalen < 2)
+            return true;
+        ch.program = data[1];
+        ch.bank = ch.controls[0] * 256 + ch.controls[32];
+        return false;
+    default:
+        return true;
+    }
+}
+
+struct performed {
+    uint16_t track;
+    const fmidi_event_t *event;
+};
+
+// events performed at the next time which has any, in order of track
+static bool next_group(
+    fmidi_seq_t *seq, channel_state *state, double *time, std::vector<performed> &group)
+{
+    group.clear();
+    fmidi_seq_event_t sqevt;
+    while (group.empty() && fmidi_seq_peek_event(seq, &sqevt)) {
+        *time = sqevt.time;
+        while (fmidi_seq_peek_event(seq, &sqevt) && std::fabs(sqevt.time - *time) < 1e-6) {
+            fmidi_seq_next_event(seq, &sqevt);
+            if (perform(sqevt.event, state))
+                group.push_back(performed{sqevt.track, sqevt.event});
+        }
+    }
+    std::stable_sort(
+        group.begin(), group.end(),
+        [](const performed &a, const performed &b) { return a.track < b.track; });
+    return !group.empty();
+}
+
+// the message as heard, with note off of velocity 64 as a note on of 0
+static void normalize_message(const fmidi_event_t *evt, uint8_t msg[3])
+{
+    memcpy(msg, evt->data, 3);
+    if ((msg[0] >> 4) == 0x8 && msg[2] == 0x40) {
+        msg[0] = 0x90 | (msg[0] & 15);
+        msg[2] = 0;
+    }
+}
+
+static bool same_event(const fmidi_event_t *a, const fmidi_event_t *b)
+{
+    if (a->type != b->type || a->datalen != b->datalen)
+        return false;
+    if (a->type == fmidi_event_message && a->datalen == 3) {
+        uint8_t ma[3], mb[3];
+        normalize_message(a, ma);
+        normalize_message(b, mb);
+        return !memcmp(ma, mb, 3);
+    }
+    return !memcmp(a->data, b->data, a->datalen);
+}
+
+static bool same_state(const channel_state &a, const channel_state &b)
+{
+    return a.program == b.program && a.bank == b.bank && a.nrpn == b.nrpn &&
+        !memcmp(a.controls, b.controls, sizeof(a.controls));
+}
+
+static bool roundtrip(const fmidi_smf_t *smf)
+{
+    uint8_t *data = nullptr;
+    size_t length = 0;
+    if (!fmidi_smf_mem_write(smf, &data, &length)) {
+        print_error();
+        return false;
+    }
+    std::unique_ptr<uint8_t, decltype(&free)> data_u(data, &free);
+
+    fmidi_smf_u opt(fmidi_smf_mem_read(data, length));
+    if (!opt) {
+        print_error();
+        return false;
+    }
+
+    fmidi_seq_u seq[2] = {
+        fmidi_seq_u(fmidi_seq_new(smf)),
+        fmidi_seq_u(fmidi_seq_new(opt.get())),
+    };
+    if (!seq[0] || !seq[1]) {
+        print_error();
+        return false;
+    }
+
+    channel_state state[2][16];
+    for (unsigned i = 0; i < 16; ++i) {
+        reset_channel(state[0][i]);
+        reset_channel(state[1][i]);
+    }
+
+    std::vector<performed> group[2];
+    size_t count = 0;
+    for (;;) {
+        double time[2];
+        bool more[2] = {
+            next_group(seq[0].get(), state[0], &time[0], group[0]),
+            next_group(seq[1].get(), state[1], &time[1], group[1]),
+        };
+
+        bool same = more[0] == more[1];
+        if (same && more[0])
+            same = std::fabs(time[0] - time[1]) < 1e-6 &&
+                group[0].size() == group[1].size();
+        for (size_t i = 0; same && more[0] && i < group[0].size(); ++i)
+            same = group[0][i].track == group[1][i].track &&
+                same_event(group[0][i].event, group[1][i].event);
+        for (unsigned i = 0; same && i < 16; ++i)
+            same = same_state(state[0][i], state[1][i]);
+
+        if (!same) {
+            fmt::print(std::cout, "Mismatch after event {}\n", count);
+            const char *names[2] = {"original", "optimized"};
+            for (unsigned k = 0; k < 2; ++k) {
+                if (!more[k])
+                    continue;
+                fmt::print(std::cout, "  {}:\n", names[k]);
+                for (const performed &pf : group[k])
+                    fmt::print(std::cout, "    ({:<3} {:<12.6f} {})\n",
+                               pf.track, time[k], *pf.event);
+            }
+            return false;
+        }
+
+        if (!more[0]) {
+            fmt::print(std::cout, "Same performance, {} events, {} bytes written\n",
+                       count, length);
+            break;
+        }
+        count += group[0].size();
+    }
+
+    return true;
+}
+
+// RPN 0/0, NRPN 1/8, then RPN 0/0 again, where the last select of RPN
+// repeats the values of the first but not the kind of parameter
+static const uint8_t rpn_nrpn_song[] = {
+    'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 96,
+    'M', 'T', 'r', 'k', 0, 0, 0, 39,
+    0, 0xb0, 101, 0, 0, 100, 0, 0, 6, 2,
+    0, 99, 1, 0, 98, 8, 0, 6, 40,
+    0, 101, 0, 0, 100, 0, 0, 6, 12,
+    96, 0x90, 60, 100, 96, 60, 0,
+    0, 0xff, 0x2f, 0,
+};
+
+static const struct {
+    const char *name;
+    const uint8_t *data;
+    size_t length;
+} builtin_songs[] = {
+    {"RPN and NRPN", rpn_nrpn_song, sizeof(rpn_nrpn_song)},
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2)
+        return 1;
+
+    fmidi_write_options_t wopts;
+    fmidi_write_options_default(&wopts);
+    wopts.flags = fmidi_write_optimize;
+    fmidi_set_write_options(&wopts);
+
+    if (argc == 2) {
+        fmidi_smf_u smf(fmidi_auto_file_read(argv[1]));
+        if (!smf) {
+            print_error();
+            return 1;
+        }
+        return roundtrip(smf.get()) ? 0 : 1;
+    }
+
+    bool success = true;
+    for (const auto &song : builtin_songs) {
+        fmt::print(std::cout, "{}: ", song.name);
+        fmidi_smf_u smf(fmidi_smf_mem_read(song.data, song.length));
+        if (!smf) {
+            print_error();
+            success = false;
+            continue;
+        }
+        success = roundtrip(smf.get()) && success;
+    }
+    return success ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Read songs, then use them from several threads at once through the const
+// functions, and check that each thread gets the same results as a serial
+// run. It is meant to be built with the thread sanitizer.
+
+#include "common.h"
+#include <fmt/format.h>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+
+static uint64_t mix(uint64_t h, uint64_t v)
+{
+    return (h ^ v) * 1099511628211u;
+}
+
+static void hash_event(const fmidi_event_t *evt, void *data)
+{
+    uint64_t &h = *(uint64_t *)data;
+    h = mix(h, evt->datalen);
+    if (evt->datalen > 0)
+        h = mix(h, evt->data[0]);
+}
+
+static uint64_t work(const std::vector<const fmidi_smf_t *> &songs, unsigned seed)
+{
+    uint64_t h = 1469598103934665603u;
+    for (size_t k = 0, n = songs.size(); k < n; ++k) {
+        const fmidi_smf_t *smf = songs[(k + seed) % n];
+
+        fmidi_seq_u seq(fmidi_seq_new(smf));
+        fmidi_seq_event_t sqevt;
+        while (fmidi_seq_next_event(seq.get(), &sqevt))
+            h = mix(h, (uint64_t)(sqevt.time * 1000) ^ sqevt.event->datalen);
+        fmidi_seq_seek_time(seq.get(), 3.0);
+        if (fmidi_seq_next_event(seq.get(), &sqevt))
+            h = mix(h, (uint64_t)(sqevt.time * 1000));
+
+        fmidi_player_u player(fmidi_player_new(smf));
+        uint64_t ph = 0;
+        fmidi_player_event_callback(player.get(), &hash_event, &ph);
+        fmidi_player_start(player.get());
+        for (unsigned i = 0; i < 200 && fmidi_player_running(player.get()); ++i)
+            fmidi_player_tick(player.get(), 0.05);
+        fmidi_player_goto_time(player.get(), 5.0);
+        h = mix(h, ph);
+
+        uint64_t tick;
+        const fmidi_event_t *evt = fmidi_track_event_at(smf, 0, 3, &tick);
+        if (evt)
+            h = mix(h, tick + evt->datalen);
+
+        uint8_t *data;
+        size_t length;
+        fmidi_smf_u slice(fmidi_smf_slice(smf, 1.0, 4.0));
+        if (slice && fmidi_smf_mem_write(slice.get(), &data, &length)) {
+            h = mix(h, length);
+            free(data);
+        }
+        if (fmidi_smf_mem_write(smf, &data, &length)) {
+            h = mix(h, length);
+            free(data);
+        }
+
+        h = mix(h, fmidi_smf_image_size(smf));
+        fmidi_resident_u res(fmidi_resident_new(smf));
+        h = mix(h, fmidi_resident_size(res.get()));
+        h = mix(h, (uint64_t)(fmidi_smf_compute_duration(smf) * 1000));
+    }
+    return h;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fmt::print(stderr, "Usage: fmidi-stress <threads> <file>...\n");
+        return 1;
+    }
+
+    unsigned nthreads = atoi(argv[1]);
+    std::vector<fmidi_smf_u> own;
+    std::vector<const fmidi_smf_t *> songs;
+    for (int i = 2; i < argc; ++i) {
+        fmidi_smf_t *smf = fmidi_auto_file_read(argv[i]);
+        if (!smf) {
+            fmt::print(stderr, "{}: ", argv[i]);
+            print_error();
+            continue;
+        }
+        // half of the songs with an index, which the readers share
+        if (i % 2)
+            fmidi_smf_build_index(smf);
+        own.emplace_back(smf);
+        songs.push_back(smf);
+    }
+    if (songs.empty())
+        return 1;
+
+    std::vector<uint64_t> serial(nthreads), parallel(nthreads);
+    for (unsigned t = 0; t < nthreads; ++t)
+        serial[t] = work(songs, t);
+
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; ++t)
+        threads.emplace_back([&songs, &parallel, t] { parallel[t] = work(songs, t); });
+    for (std::thread &thread : threads)
+        thread.join();
+
+    unsigned differing = 0;
+    for (unsigned t = 0; t < nthreads; ++t)
+        differing += serial[t] != parallel[t];
+
+    fmt::print("{} songs, {} threads, {} results differing from serial\n",
+               songs.size(), nthreads, differing);
+    return differing ? 1 : 0;
+}
@@ -34,6 +34,9 @@ fmidi_smf_t *fmidi_mus_mem_read(const uint8_t *data, size_t length)
         (ms = mb.skip(2)))
         RET_FAIL(nullptr, fmidi_err_format);
 
+    if (instr_cnt > (mb.endpos() - mb.getpos()) / 2)
+        RET_FAIL(nullptr, fmidi_err_format);
+
     std::unique_ptr<uint32_t[]> instrs{new uint32_t[instr_cnt]};
     for (uint32_t i = 0; i < instr_cnt; ++i) {
         if ((ms = mb.readintLE(&instrs[i], 2)))
@@ -53,6 +56,9 @@ fmidi_smf_t *fmidi_mus_mem_read(const uint8_t *data, size_t length)
     uint32_t ev_delta = 0;
     uint32_t note_velocity[16] = {};
 
+    uint32_t evlimit = fmidi_read_opts.event_limit;
+    uint32_t evcount = 0;
+
     for (unsigned channel = 0; channel < 16; ++channel) {
         // initial velocity
         note_velocity[channel] = 64;
@@ -67,7 +73,13 @@ fmidi_smf_t *fmidi_mus_mem_read(const uint8_t *data, size_t length)
         data[2] = 127;
     }
 
+    uint32_t carry = 0;  // delta of filtered events
+    fmidi_event_filter(evbuf, 0, &carry);
+
     for (bool score_end = false; !score_end;) {
+        if (evlimit && ++evcount > evlimit)
+            RET_FAIL(nullptr, fmidi_err_limit);
+
         uint32_t ev_desc;
         if ((ms = mb.readintLE(&ev_desc, 1)))
             RET_FAIL(nullptr, fmidi_err_format);
@@ -206,6 +218,7 @@ fmidi_smf_t *fmidi_mus_mem_read(const uint8_t *data, size_t length)
             event->datalen = midi_size;
             memcpy(event->data, midi, midi_size);
             ev_delta = 0;
+            fmidi_event_filter(evbuf, (uint8_t *)event - evbuf.data(), &carry);
         }
 
         ev_delta += delta_inc;
@@ -216,11 +229,9 @@ fmidi_smf_t *fmidi_mus_mem_read(const uint8_t *data, size_t length)
     event->delta = ev_delta;
     event->datalen = 1;
     event->data[0] = 0x2f;
+    fmidi_event_filter(evbuf, (uint8_t *)event - evbuf.data(), &carry);
 
-    uint32_t evdatalen = track.length = evbuf.size();
-    uint8_t *evdata = new uint8_t[evdatalen];
-    track.data.reset(evdata);
-    memcpy(evdata, evbuf.data(), evdatalen);
+    fmidi_track_store(track, evbuf);
 
     return smf.release();
 }
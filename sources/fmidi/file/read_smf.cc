@@ -84,6 +84,9 @@ static fmidi_event_t *fmidi_read_escape_event(
     const uint8_t *data;
     if ((ms = mb.readvlq(&datalen)))
         RET_FAIL(nullptr, (fmidi_status)ms);
+    uint32_t limit = fmidi_read_opts.sysex_limit;
+    if (limit && datalen > limit)
+        RET_FAIL(nullptr, fmidi_err_limit);
     if (!(data = mb.read(datalen)))
         RET_FAIL(nullptr, fmidi_err_eof);
 
@@ -96,14 +99,11 @@ static fmidi_event_t *fmidi_read_escape_event(
 }
 
 static fmidi_event_t *fmidi_read_sysex_event(
-    memstream &mb, std::vector<uint8_t> &evbuf, uint32_t delta)
+    memstream &mb, std::vector<uint8_t> &evbuf, uint32_t delta, bool *repaired)
 {
     memstream_status ms;
     fmidi_event_t *evt;
-
-    std::vector<uint8_t> syxbuf;
-    syxbuf.reserve(256);
-    syxbuf.push_back(0xf0);
+    uint32_t limit = fmidi_read_opts.sysex_limit;
 
     uint32_t partlen;
     const uint8_t *part;
@@ -117,13 +117,17 @@ static fmidi_event_t *fmidi_read_sysex_event(
 
     // handle files having multiple concatenated sysex events in one
     while ((endp = (const uint8_t *)memchr(part, 0xf7, partlen))) {
-        syxbuf.insert(syxbuf.end(), part, endp + 1);
+        uint32_t syxlen = endp + 2 - part;
+        if (limit && syxlen > limit)
+            RET_FAIL(nullptr, fmidi_err_limit);
 
-        evt = fmidi_event_alloc(evbuf, syxbuf.size());
+        // copy once, directly into the event
+        evt = fmidi_event_alloc(evbuf, syxlen);
         evt->type = fmidi_event_message;
         evt->delta = delta;
-        evt->datalen = syxbuf.size();
-        memcpy(&evt->data[0], &syxbuf[0], syxbuf.size());
+        evt->datalen = syxlen;
+        evt->data[0] = 0xf0;
+        memcpy(&evt->data[1], part, syxlen - 1);
 
         uint32_t reallen = endp + 1 - part;
         partlen -= reallen;
@@ -132,6 +136,8 @@ static fmidi_event_t *fmidi_read_sysex_event(
         if (partlen == 0)
             return evt;
 
+        if (repaired)
+            *repaired = true;
         if (part[0] != 0xf0) {
 #if 1
             // trailing garbage, ignore
@@ -143,18 +149,20 @@ static fmidi_event_t *fmidi_read_sysex_event(
         }
         ++part;
         --partlen;
-
-        syxbuf.clear();
-        syxbuf.push_back(0xf0);
     }
 
     // handle the rest in multiple parts (Casio MIDI)
+    std::vector<uint8_t> syxbuf;
+    syxbuf.reserve(256);
+    syxbuf.push_back(0xf0);
     while (!term) {
         term = endp;
         if (term && endp + 1 != part + partlen) {
             // ensure no excess bytes
             RET_FAIL(nullptr, fmidi_err_format);
         }
+        if (limit && (uint64_t)syxbuf.size() + partlen > limit)
+            RET_FAIL(nullptr, fmidi_err_limit);
         syxbuf.insert(syxbuf.end(), part, part + partlen);
 
         if (!term) {
@@ -177,6 +185,8 @@ static fmidi_event_t *fmidi_read_sysex_event(
             else {
                 // no next part? assume unfinished message and repair
                 mb.setpos(offset);
+                if (repaired)
+                    *repaired = true;
                 syxbuf.push_back(0xf7);
                 term = true;
             }
@@ -211,7 +221,8 @@ static fmidi_event_t *fmidi_read_message_event(
 }
 
 static fmidi_event_t *fmidi_read_event(
-    memstream &mb, std::vector<uint8_t> &evbuf, uint8_t *runstatus)
+    memstream &mb, std::vector<uint8_t> &evbuf, uint8_t *runstatus,
+    bool *running = nullptr, bool *repaired = nullptr)
 {
     memstream_status ms;
     uint32_t delta;
@@ -229,7 +240,7 @@ static fmidi_event_t *fmidi_read_event(
         evt = fmidi_read_escape_event(mb, evbuf, delta);
     }
     else if (id == 0xf0) {
-        evt = fmidi_read_sysex_event(mb, evbuf, delta);
+        evt = fmidi_read_sysex_event(mb, evbuf, delta, repaired);
     }
     else {
         if (id & 128) {
@@ -238,6 +249,8 @@ static fmidi_event_t *fmidi_read_event(
         else {
             id = *runstatus;
             mb.setpos(mb.getpos() - 1);
+            if (running)
+                *running = true;
         }
         evt = fmidi_read_message_event(mb, evbuf, id, delta);
     }
@@ -245,6 +258,12 @@ static fmidi_event_t *fmidi_read_event(
     return evt;
 }
 
+fmidi_event_t *fmidi_smf_read_event(
+    memstream &mb, std::vector<uint8_t> &evbuf, uint8_t *runstatus)
+{
+    return fmidi_read_event(mb, evbuf, runstatus);
+}
+
 void fmidi_smf_track_begin(fmidi_track_iter_t *it, uint16_t track)
 {
     it->track = track;
@@ -265,18 +284,28 @@ const fmidi_event_t *fmidi_smf_track_next(
         return nullptr;
 
     it->index += fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
-    return evt;
+    return fmidi_track_resolve(trk, evt);
 }
 
-static bool fmidi_smf_read_contents(fmidi_smf_t *smf, memstream &mb)
+static bool fmidi_smf_read_contents(
+    fmidi_smf_t *smf, memstream &mb, const std::shared_ptr<uint8_t> &source)
 {
     uint16_t ntracks = smf->info.track_count;
+    uint32_t evlimit = fmidi_read_opts.event_limit;
+    uint32_t evcount = 0;
+
+    // do not allocate for more tracks than the input can hold, the extra
+    // one is where reading stops with the usual repairs
+    size_t trkcapacity = (mb.endpos() - mb.getpos()) / 8 + 1;
+    if (ntracks > trkcapacity)
+        ntracks = trkcapacity;
     smf->track.reset(new fmidi_raw_track[ntracks]);
 
     std::vector<uint8_t> evbuf;
     evbuf.reserve(8192);
 
     uint8_t runstatus = 0;  // status runs from track to track
+    bool filtering = fmidi_read_opts.filter || fmidi_read_opts.filter_fn;
 
     for (unsigned itrack = 0; itrack < ntracks; ++itrack) {
         fmidi_raw_track &trk = smf->track[itrack];
@@ -312,11 +341,30 @@ static bool fmidi_smf_read_contents(fmidi_smf_t *smf, memstream &mb)
         fmidi_event_t *evt;
         size_t evoffset = mb.getpos();
         bool endoftrack = false;
+        uint32_t carry = 0;  // delta of filtered events
+        bool ownstatus = false;  // whether the track has set the status
+        bool clean = source && !filtering && tracklengood;
         evbuf.clear();
-        while (!endoftrack && (evt = fmidi_read_event(mb, evbuf, &runstatus))) {
+        bool running = false;
+        bool repaired = false;
+        while (!endoftrack) {
+            // a sysex packet can give several events, filter all of them
+            size_t evstart = evbuf.size();
+            if (!(evt = fmidi_read_event(mb, evbuf, &runstatus, &running, &repaired)))
+                break;
+            if (!ownstatus && evt->type == fmidi_event_message && evt->data[0] < 0xf0) {
+                // a track continuing the status of the previous one is not
+                // valid on its own, and it will not be copied as is
+                ownstatus = true;
+                clean = clean && !running;
+            }
+            if (evlimit && ++evcount > evlimit)
+                RET_FAIL(false, fmidi_err_limit);
             // some files use 3F instead or 2F for end of track
             endoftrack = evt->type == fmidi_event_meta &&
                 (evt->data[0] == 0x2f || evt->data[0] == 0x3f);
+            clean = clean && !(endoftrack && evt->data[0] == 0x3f);
+            fmidi_event_filter(evbuf, evstart, &carry);
             // fmt::print(stderr, "T{} @{:#x} {}\n", itrack, evoffset, *evt);
             evoffset = mb.getpos();
             if (tracklengood && evoffset > trkoffset + 8 + tracklen)
@@ -325,6 +373,7 @@ static bool fmidi_smf_read_contents(fmidi_smf_t *smf, memstream &mb)
         }
 
         if (!endoftrack) {
+            clean = false;
             switch (fmidi_last_error.code) {
             case fmidi_err_eof:
                 // truncated track? stop reading
@@ -349,6 +398,8 @@ static bool fmidi_smf_read_contents(fmidi_smf_t *smf, memstream &mb)
             // permit meta events coming after end of track
             const uint8_t *head;
             while ((head = mb.peek(2)) && head[0] == 0x00 && head[1] == 0xff) {
+                size_t evstart = evbuf.size();
+                clean = false;
                 if (!(evt = fmidi_read_event(mb, evbuf, &runstatus))) {
                     if (fmidi_last_error.code == fmidi_err_eof)
                         smf->info.track_count = ntracks = itrack + 1;
@@ -358,37 +409,238 @@ static bool fmidi_smf_read_contents(fmidi_smf_t *smf, memstream &mb)
                 else if (tracklengood && mb.getpos() > trkoffset + 8 + tracklen)
                     // next track overlap
                     RET_FAIL(false, fmidi_err_format);
+                else if (evlimit && ++evcount > evlimit)
+                    RET_FAIL(false, fmidi_err_limit);
+                else
+                    fmidi_event_filter(evbuf, evstart, &carry);
             }
         }
 
-        uint32_t evdatalen = trk.length = evbuf.size();
-        uint8_t *evdata = new uint8_t[evdatalen];
-        trk.data.reset(evdata);
-        memcpy(evdata, evbuf.data(), evdatalen);
+        fmidi_track_store(trk, evbuf);
+
+        // repaired events, or bytes left after the end of track
+        clean = clean && !repaired &&
+            mb.getpos() == trkoffset + 8 + tracklen;
+        if (clean) {
+            trk.source = std::shared_ptr<const uint8_t>(
+                source, source.get() + trkoffset + 8);
+            trk.sourcelength = tracklen;
+        }
 
         if (tracklengood)
             mb.setpos(trkoffset + 8 + tracklen);
     }
 
+    smf->info.track_count = ntracks;
     return true;
 }
 
-fmidi_smf_t *fmidi_smf_mem_read(const uint8_t *data, size_t length)
+//------------------------------------------------------------------------------
+// strict reader: no repairs, each track decoded within its chunk
+
+static bool fmidi_strict_readvlq(
+    const uint8_t *&p, const uint8_t *e, uint32_t *retp)
+{
+    uint32_t ret = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+        if (p == e)
+            RET_FAIL(false, fmidi_err_eof);
+        uint8_t byte = *p++;
+        ret = (ret << 7) | (byte & 127);
+        if (!(byte & 128)) {
+            *retp = ret;
+            return true;
+        }
+    }
+    RET_FAIL(false, fmidi_err_format);
+}
+
+static bool fmidi_smf_read_track_strict(
+    const uint8_t *p, const uint8_t *e, std::vector<uint8_t> &evbuf,
+    std::vector<uint8_t> &syxbuf, uint32_t *evcount)
+{
+    uint32_t evlimit = fmidi_read_opts.event_limit;
+    uint32_t sxlimit = fmidi_read_opts.sysex_limit;
+    unsigned runstatus = 0;
+    uint32_t carry = 0;  // delta of filtered events
+
+    for (bool endoftrack = false; !endoftrack;) {
+        if (evlimit && ++*evcount > evlimit)
+            RET_FAIL(false, fmidi_err_limit);
+
+        uint32_t delta;
+        if (!fmidi_strict_readvlq(p, e, &delta))
+            return false;
+        if (p == e)
+            RET_FAIL(false, fmidi_err_eof);
+
+        fmidi_event_t *evt;
+        unsigned id = *p++;
+
+        if (id == 0xff) {
+            if (p == e)
+                RET_FAIL(false, fmidi_err_eof);
+            unsigned type = *p++;
+            uint32_t len;
+            if (!fmidi_strict_readvlq(p, e, &len))
+                return false;
+            if ((size_t)(e - p) < len)
+                RET_FAIL(false, fmidi_err_eof);
+            // end of track, which must end the chunk
+            endoftrack = type == 0x2f;
+            if (endoftrack && (len != 0 || p != e))
+                RET_FAIL(false, fmidi_err_format);
+            evt = fmidi_event_alloc(evbuf, len + 1);
+            evt->type = fmidi_event_meta;
+            evt->delta = delta;
+            evt->datalen = len + 1;
+            evt->data[0] = type;
+            memcpy(&evt->data[1], p, len);
+            p += len;
+        }
+        else if (id == 0xf0) {
+            // message possibly divided in packets, until the terminator
+            syxbuf.assign(1, 0xf0);
+            for (bool term = false; !term;) {
+                uint32_t len;
+                if (!fmidi_strict_readvlq(p, e, &len))
+                    return false;
+                if ((size_t)(e - p) < len)
+                    RET_FAIL(false, fmidi_err_eof);
+                const uint8_t *endp = (const uint8_t *)memchr(p, 0xf7, len);
+                if (endp && endp + 1 != p + len)
+                    RET_FAIL(false, fmidi_err_format);
+                if (sxlimit && (uint64_t)syxbuf.size() + len > sxlimit)
+                    RET_FAIL(false, fmidi_err_limit);
+                syxbuf.insert(syxbuf.end(), p, p + len);
+                p += len;
+                term = endp;
+                if (!term) {
+                    uint32_t contdelta;
+                    if (!fmidi_strict_readvlq(p, e, &contdelta))
+                        return false;
+                    if (p == e)
+                        RET_FAIL(false, fmidi_err_eof);
+                    if (*p++ != 0xf7)
+                        RET_FAIL(false, fmidi_err_format);
+                }
+            }
+            evt = fmidi_event_alloc(evbuf, syxbuf.size());
+            evt->type = fmidi_event_message;
+            evt->delta = delta;
+            evt->datalen = syxbuf.size();
+            memcpy(&evt->data[0], syxbuf.data(), syxbuf.size());
+        }
+        else if (id == 0xf7) {
+            uint32_t len;
+            if (!fmidi_strict_readvlq(p, e, &len))
+                return false;
+            if ((size_t)(e - p) < len)
+                RET_FAIL(false, fmidi_err_eof);
+            if (sxlimit && len > sxlimit)
+                RET_FAIL(false, fmidi_err_limit);
+            evt = fmidi_event_alloc(evbuf, len);
+            evt->type = fmidi_event_escape;
+            evt->delta = delta;
+            evt->datalen = len;
+            memcpy(&evt->data[0], p, len);
+            p += len;
+        }
+        else {
+            if (id & 128) {
+                if (id >= 0xf0)
+                    RET_FAIL(false, fmidi_err_format);
+                runstatus = id;
+            }
+            else {
+                if (!runstatus)
+                    RET_FAIL(false, fmidi_err_format);
+                id = runstatus;
+                --p;
+            }
+            unsigned len = fmidi_message_sizeof(id);
+            if ((size_t)(e - p) < len - 1)
+                RET_FAIL(false, fmidi_err_eof);
+            evt = fmidi_event_alloc(evbuf, len);
+            evt->type = fmidi_event_message;
+            evt->delta = delta;
+            evt->datalen = len;
+            evt->data[0] = id;
+            for (unsigned i = 1; i < len; ++i)
+                evt->data[i] = *p++;
+        }
+
+        fmidi_event_filter(evbuf, (uint8_t *)evt - evbuf.data(), &carry);
+    }
+
+    return true;
+}
+
+static bool fmidi_smf_read_contents_strict(
+    fmidi_smf_t *smf, memstream &mb, const std::shared_ptr<uint8_t> &source)
+{
+    uint16_t ntracks = smf->info.track_count;
+    if (ntracks > (mb.endpos() - mb.getpos()) / 8)
+        RET_FAIL(false, fmidi_err_eof);
+    smf->track.reset(new fmidi_raw_track[ntracks]);
+
+    std::vector<uint8_t> evbuf;
+    evbuf.reserve(8192);
+    std::vector<uint8_t> syxbuf;
+    uint32_t evcount = 0;
+    bool filtering = fmidi_read_opts.filter || fmidi_read_opts.filter_fn;
+
+    for (unsigned itrack = 0; itrack < ntracks;) {
+        memstream_status ms;
+        const uint8_t *chunkmagic;
+        uint32_t chunklen;
+        const uint8_t *chunkdata;
+
+        if (!(chunkmagic = mb.read(4)))
+            RET_FAIL(false, fmidi_err_eof);
+        if ((ms = mb.readintBE(&chunklen, 4)))
+            RET_FAIL(false, (fmidi_status)ms);
+        if (!(chunkdata = mb.read(chunklen)))
+            RET_FAIL(false, fmidi_err_eof);
+
+        if (memcmp(chunkmagic, "MTrk", 4))
+            continue;  // skip unknown chunks, as the standard says
+
+        evbuf.clear();
+        if (!fmidi_smf_read_track_strict(
+                chunkdata, chunkdata + chunklen, evbuf, syxbuf, &evcount))
+            return false;
+
+        fmidi_raw_track &trk = smf->track[itrack++];
+        fmidi_track_store(trk, evbuf);
+
+        if (source && !filtering) {
+            trk.source = std::shared_ptr<const uint8_t>(
+                source, source.get() + mb.getpos() - chunklen);
+            trk.sourcelength = chunklen;
+        }
+    }
+
+    return true;
+}
+
+// read from data, which `source` owns if the tracks are to be retained
+static fmidi_smf_t *fmidi_smf_read(
+    const uint8_t *data, size_t length, const std::shared_ptr<uint8_t> &source)
 {
     memstream mb(data, length);
     memstream_status ms;
-    const uint8_t *filemagic;
     uint32_t headerlen;
     uint32_t format;
     uint32_t ntracks;
     uint32_t deltaunit;
 
-    while ((filemagic = mb.peek(4)) && memcmp(filemagic, "MThd", 4))
-        mb.skip(1);
-    mb.skip(4);
-
-    if (!filemagic)
+    const uint8_t header[] = {'M', 'T', 'h', 'd'};
+    const uint8_t *start = std::search(
+        data, data + length, header, header + sizeof(header));
+    if (start == data + length)
         RET_FAIL(nullptr, fmidi_err_format);
+    mb.setpos(start + 4 - data);
 
     if ((ms = mb.readintBE(&headerlen, 4)) ||
         (ms = mb.readintBE(&format, 2)) ||
@@ -399,6 +651,14 @@ fmidi_smf_t *fmidi_smf_mem_read(const uint8_t *data, size_t length)
     if (ntracks < 1 || headerlen < 6)
         RET_FAIL(nullptr, fmidi_err_format);
 
+    uint32_t trklimit = fmidi_read_opts.track_limit;
+    if (trklimit && ntracks > trklimit)
+        RET_FAIL(nullptr, fmidi_err_limit);
+
+    bool strict = fmidi_read_opts.flags & fmidi_read_strict;
+    if (strict && (format > 2 || (format == 0 && ntracks != 1)))
+        RET_FAIL(nullptr, fmidi_err_format);
+
     if ((ms = mb.skip(headerlen - 6)))
         RET_FAIL(nullptr, (fmidi_status)ms);
 
@@ -407,12 +667,29 @@ fmidi_smf_t *fmidi_smf_mem_read(const uint8_t *data, size_t length)
     smf->info.track_count = ntracks;
     smf->info.delta_unit = deltaunit;
 
-    if (!fmidi_smf_read_contents(smf.get(), mb))
-        return nullptr;
+    if (strict) {
+        if (!fmidi_smf_read_contents_strict(smf.get(), mb, source))
+            return nullptr;
+    }
+    else {
+        if (!fmidi_smf_read_contents(smf.get(), mb, source))
+            return nullptr;
+    }
 
     return smf.release();
 }
 
+fmidi_smf_t *fmidi_smf_mem_read(const uint8_t *data, size_t length)
+{
+    if (!(fmidi_read_opts.flags & fmidi_read_keep_source))
+        return fmidi_smf_read(data, length, nullptr);
+
+    std::shared_ptr<uint8_t> source(
+        new uint8_t[length], std::default_delete<uint8_t[]>());
+    memcpy(source.get(), data, length);
+    return fmidi_smf_read(source.get(), length, source);
+}
+
 void fmidi_smf_free(fmidi_smf_t *smf)
 {
     delete smf;
@@ -442,10 +719,13 @@ fmidi_smf_t *fmidi_smf_stream_read(FILE *stream)
     if (length > fmidi_file_size_limit)
         RET_FAIL(nullptr, fmidi_err_largefile);
 
-    std::unique_ptr<uint8_t[]> buf(new uint8_t[length]);
+    std::shared_ptr<uint8_t> buf(
+        new uint8_t[length], std::default_delete<uint8_t[]>());
     if (!fread(buf.get(), length, 1, stream))
         RET_FAIL(nullptr, fmidi_err_input);
 
-    fmidi_smf_t *smf = fmidi_smf_mem_read(buf.get(), length);
+    // the buffer is retained as the source, without a copy
+    bool keep = fmidi_read_opts.flags & fmidi_read_keep_source;
+    fmidi_smf_t *smf = fmidi_smf_read(buf.get(), length, keep ? buf : nullptr);
     return smf;
 }
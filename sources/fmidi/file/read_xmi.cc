@@ -9,6 +9,8 @@
 #include "fmidi/u_memstream.h"
 #include "fmidi/u_stdio.h"
 #include <algorithm>
+#include <queue>
+#include <functional>
 #include <string.h>
 #include <sys/stat.h>
 #if defined(_WIN32)
@@ -32,56 +34,58 @@ struct fmidi_xmi_rbrn {
 };
 
 struct fmidi_xmi_note {
-    uint32_t delta;
+    uint64_t time;  // absolute time of the note off
+    uint32_t order;
     uint8_t channel;
     uint8_t note;
     uint8_t velo;
 };
 
-static bool operator<(const fmidi_xmi_note &a, const fmidi_xmi_note &b)
+// ordering of the note off queue, earliest first, then first noted first
+static bool operator>(const fmidi_xmi_note &a, const fmidi_xmi_note &b)
 {
-    return a.delta < b.delta;
+    return (a.time != b.time) ? (a.time > b.time) : (a.order > b.order);
 }
 
-static void fmidi_xmi_emit_noteoffs(
-    uint32_t *pdelta, std::vector<fmidi_xmi_note> &noteoffs,
-    std::vector<uint8_t> &evbuf)
+static bool operator<(const fmidi_xmi_rbrn &a, const fmidi_xmi_rbrn &b)
 {
-    uint32_t delta = *pdelta;
+    return a.dest < b.dest;
+}
 
-    std::sort(noteoffs.begin(), noteoffs.end());
+typedef std::priority_queue<
+    fmidi_xmi_note, std::vector<fmidi_xmi_note>,
+    std::greater<fmidi_xmi_note>> fmidi_xmi_noteoff_queue;
 
-    size_t i = 0;
-    size_t n = noteoffs.size();
+static bool fmidi_xmi_delta(uint64_t time, uint64_t *plast, uint32_t *pdelta)
+{
+    uint64_t delta = time - *plast;
+    if (delta > UINT32_MAX)
+        RET_FAIL(false, fmidi_err_format);
+    *plast = time;
+    *pdelta = delta;
+    return true;
+}
 
-    for (; i < n; ++i) {
-        fmidi_xmi_note xn = noteoffs[i];
-        if (delta < xn.delta)
-            break;
+static bool fmidi_xmi_emit_noteoffs(
+    uint64_t time, uint64_t *plast, fmidi_xmi_noteoff_queue &noteoffs,
+    std::vector<uint8_t> &evbuf)
+{
+    while (!noteoffs.empty() && noteoffs.top().time <= time) {
+        fmidi_xmi_note xn = noteoffs.top();
+        noteoffs.pop();
 
         fmidi_event_t *event = fmidi_event_alloc(evbuf, 3);
         event->type = fmidi_event_message;
-        event->delta = xn.delta;
+        if (!fmidi_xmi_delta(xn.time, plast, &event->delta))
+            return false;
         event->datalen = 3;
 
         uint8_t *data = event->data;
         data[0] = 0x80 | xn.channel;
         data[1] = xn.note;
         data[2] = xn.velo;
-
-        delta -= xn.delta;
-        for (size_t k = i + 1; k < n; ++k)
-            noteoffs[k].delta -= xn.delta;
-    }
-
-    size_t j = 0;
-    for (; i < n; ++i) {
-        fmidi_xmi_note xn = noteoffs[i];
-        noteoffs[j++] = xn;
     }
-    noteoffs.resize(j);
-
-    *pdelta = delta;
+    return true;
 }
 
 static bool fmidi_xmi_read_events(
@@ -93,8 +97,17 @@ static bool fmidi_xmi_read_events(
     std::vector<uint8_t> evbuf;
     evbuf.reserve(8192);
 
-    std::vector<fmidi_xmi_note> noteoffs;
-    noteoffs.reserve(128);
+    uint32_t evlimit = fmidi_read_opts.event_limit;
+    uint32_t sxlimit = fmidi_read_opts.sysex_limit;
+    uint32_t evcount = 0;
+
+    fmidi_xmi_noteoff_queue noteoffs;
+    uint32_t noteorder = 0;
+
+    // branches sorted by destination, met in order as the stream advances
+    std::vector<fmidi_xmi_rbrn> branches(rbrn, rbrn + rbrn_count);
+    std::stable_sort(branches.begin(), branches.end());
+    size_t nextbranch = 0;
 
     for (uint32_t i = 0; i < timb_count; ++i) {
         fmidi_event_t *event = fmidi_event_alloc(evbuf, 2);
@@ -106,33 +119,49 @@ static bool fmidi_xmi_read_events(
         data[1] = timb[i].bank;
     }
 
+    uint32_t carry = 0;  // delta of filtered events
+    fmidi_event_filter(evbuf, 0, &carry);
+
+    // absolute time of the stream, and of the last event emitted
+    uint64_t time = 0;
+    uint64_t last = 0;
+
     bool eot = false;
     while (!eot) {
-        uint32_t delta = 0;
         unsigned status = 0;
+        size_t evstart = evbuf.size();
+
+        if (evlimit && ++evcount > evlimit)
+            RET_FAIL(false, fmidi_err_limit);
 
+        size_t pos = mb.getpos();
+        while (nextbranch < branches.size() && branches[nextbranch].dest < pos)
+            ++nextbranch;
         size_t branch = ~(size_t)0;
-        for (uint32_t i = 0; i < rbrn_count && branch == ~(size_t)0; ++i) {
-            if (rbrn[i].dest == mb.getpos())
-                branch = i;
-        }
+        if (nextbranch < branches.size() && branches[nextbranch].dest == pos)
+            branch = nextbranch;
 
         while (!(status & 128)) {
             if ((ms = mb.readbyte(&status)))
                 RET_FAIL(false, (fmidi_status)ms);
-            delta += (status & 128) ? 0 : status;
+            time += (status & 128) ? 0 : status;
         }
 
+        if (!fmidi_xmi_emit_noteoffs(time, &last, noteoffs, evbuf))
+            return false;
+
         if (branch != ~(size_t)0) {
             fmidi_event_t *event = fmidi_event_alloc(evbuf, 1);
             event->type = fmidi_event_xmi_branch_point;
-            event->delta = delta;
+            if (!fmidi_xmi_delta(time, &last, &event->delta))
+                return false;
             event->datalen = 1;
-            event->data[0] = rbrn[branch].id;
-            delta = 0;
+            event->data[0] = branches[branch].id;
         }
 
-        fmidi_xmi_emit_noteoffs(&delta, noteoffs, evbuf);
+        uint32_t delta;
+        if (!fmidi_xmi_delta(time, &last, &delta))
+            return false;
 
         if (status == 0xff) {
             unsigned type;
@@ -147,11 +176,9 @@ static bool fmidi_xmi_read_events(
 
             eot = type == 0x2F;
 
-            if (eot) {
-                // emit later
-            }
-            else if (type == 0x51) {
-                // don't emit tempo change
+            if (eot || type == 0x51) {
+                // emit end of track later, don't emit tempo change
+                last -= delta;
             }
             else {
                 fmidi_event_t *event = fmidi_event_alloc(evbuf, length + 1);
@@ -166,6 +193,8 @@ static bool fmidi_xmi_read_events(
             uint32_t length;
             if ((ms = mb.readvlq(&length)))
                 RET_FAIL(false, (fmidi_status)ms);
+            if (sxlimit && length >= sxlimit)
+                RET_FAIL(false, fmidi_err_limit);
 
             const uint8_t *data = mb.read(length);
             if (!data)
@@ -198,11 +227,12 @@ static bool fmidi_xmi_read_events(
             memcpy(event->data, data, 3);
 
             fmidi_xmi_note noteoff;
-            noteoff.delta = interval;
+            noteoff.time = time + interval;
+            noteoff.order = noteorder++;
             noteoff.channel = data[0] & 15;
             noteoff.note = data[1];
             noteoff.velo = data[2];
-            noteoffs.push_back(noteoff);
+            noteoffs.push(noteoff);
         }
         else {
             unsigned length = fmidi_message_sizeof(status);
@@ -217,13 +247,14 @@ static bool fmidi_xmi_read_events(
             event->datalen = length;
             memcpy(event->data, data, length);
         }
-    }
 
-    {
-        uint32_t delta = UINT32_MAX;
-        fmidi_xmi_emit_noteoffs(&delta, noteoffs, evbuf);
+        fmidi_event_filter(evbuf, evstart, &carry);
     }
 
+    size_t evstart = evbuf.size();
+    if (!fmidi_xmi_emit_noteoffs(UINT64_MAX, &last, noteoffs, evbuf))
+        return false;
+
     {
         fmidi_event_t *event = fmidi_event_alloc(evbuf, 1);
         event->type = fmidi_event_meta;
@@ -232,10 +263,9 @@ static bool fmidi_xmi_read_events(
         event->data[0] = 0x2F;
     }
 
-    uint32_t evdatalen = track.length = evbuf.size();
-    uint8_t *evdata = new uint8_t[evdatalen];
-    track.data.reset(evdata);
-    memcpy(evdata, evbuf.data(), evdatalen);
+    fmidi_event_filter(evbuf, evstart, &carry);
+
+    fmidi_track_store(track, evbuf);
 
     return true;
 }
@@ -286,6 +316,8 @@ static bool fmidi_xmi_read_track(memstream &mb, fmidi_raw_track &track)
             case FOURCC("TIMB"): {
                 if ((ms = mbchunk.readintLE(&timb_count, 2)))
                     RET_FAIL(false, (fmidi_status)ms);
+                if (timb_count > (chunksize - 2) / 2)
+                    RET_FAIL(false, fmidi_err_eof);
 
                 timb.reset(new fmidi_xmi_timb[timb_count]);
                 for (uint32_t i = 0; i < timb_count; ++i) {
@@ -299,6 +331,8 @@ static bool fmidi_xmi_read_track(memstream &mb, fmidi_raw_track &track)
             case FOURCC("RBRN"): {
                 if ((ms = mbchunk.readintLE(&rbrn_count, 2)))
                     RET_FAIL(false, (fmidi_status)ms);
+                if (rbrn_count > (chunksize - 2) / 6)
+                    RET_FAIL(false, fmidi_err_eof);
 
                 rbrn.reset(new fmidi_xmi_rbrn[rbrn_count]);
                 for (uint32_t i = 0; i < rbrn_count; ++i) {
@@ -385,6 +419,10 @@ fmidi_smf_t *fmidi_xmi_mem_read(const uint8_t *data, size_t length)
     if (ntracks < 1)
         RET_FAIL(nullptr, fmidi_err_format);
 
+    uint32_t trklimit = fmidi_read_opts.track_limit;
+    if (trklimit && ntracks > trklimit)
+        RET_FAIL(nullptr, fmidi_err_limit);
+
     const uint8_t *fourcc;
     if (!(fourcc = mb.read(4)))
         RET_FAIL(nullptr, fmidi_err_eof);
@@ -402,6 +440,10 @@ fmidi_smf_t *fmidi_xmi_mem_read(const uint8_t *data, size_t length)
     if (memcmp(fourcc, "XMID", 4))
         RET_FAIL(nullptr, fmidi_err_format);
 
+    // each track is at least a chunk header
+    if (ntracks > (mb.endpos() - mb.getpos()) / 8)
+        RET_FAIL(nullptr, fmidi_err_eof);
+
     fmidi_smf_u smf(new fmidi_smf);
     smf->info.format = (ntracks > 1) ? 2 : 0;
     smf->info.track_count = ntracks;
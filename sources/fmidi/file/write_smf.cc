@@ -4,8 +4,12 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
 #include "fmidi/fmidi_internal.h"
+#include "fmidi/fmidi_chase.h"
 #include "fmidi/u_stdio.h"
+#include <unordered_set>
+#include <algorithm>
 #include <cstring>
 #include <cassert>
 
@@ -22,6 +26,275 @@ static void write_vlq(uint32_t value, Writer &writer)
     writer.put(value & mask);
 }
 
+// whether the event is a no-op when its contents are empty
+static bool fmidi_event_empty(const fmidi_event_t *event)
+{
+    switch (event->type) {
+    case fmidi_event_meta: {
+        uint8_t tag = event->data[0];
+        return event->datalen == 1 && ((tag >= 0x01 && tag <= 0x0f) || tag == 0x7f);
+    }
+    case fmidi_event_message:
+        return event->data[0] == 0xf0 && event->datalen == 2;
+    case fmidi_event_escape:
+        return event->datalen == 0;
+    default:
+        return false;
+    }
+}
+
+// events are designated by track and by position in the track, because an
+// interned event can have several occurrences
+static uint64_t fmidi_repeat_key(unsigned track, uint32_t index)
+{
+    return ((uint64_t)track << 32) | index;
+}
+
+// channels which the event brings to a state unknown to the writer: mode
+// messages, reset of all controllers, and reset system exclusive
+static unsigned fmidi_change_resets(const fmidi_event_t *event)
+{
+    uint8_t status = event->data[0];
+    if (status == 0xf0)
+        return fmidi_chase_is_reset_sysex(event->data, event->datalen) ? 0xffff : 0;
+    if ((status >> 4) == 0xb && event->datalen >= 3 && event->data[1] >= 120)
+        return 1u << (status & 15);
+    return 0;
+}
+
+// whether the event selects a registered or non-registered parameter
+static bool fmidi_change_selects(const fmidi_event_t *event)
+{
+    uint8_t status = event->data[0];
+    return (status >> 4) == 0xb && event->datalen >= 3 &&
+        event->data[1] >= 98 && event->data[1] <= 101;
+}
+
+// find the control and program changes which do not change the state of
+// their channel. the state is shared by the tracks, except in format 2.
+static void fmidi_smf_find_repeats(
+    const fmidi_smf_t *smf, std::unordered_set<uint64_t> &repeats)
+{
+    struct change {
+        uint64_t tick;
+        uint16_t track;
+        uint32_t index;
+        const fmidi_event_t *event;
+    };
+
+    unsigned ntracks = smf->info.track_count;
+    bool shared = smf->info.format != 2;
+    std::vector<change> changes;
+
+    for (unsigned i = 0; i < ntracks; ++i) {
+        fmidi_track_iter_t iter;
+        fmidi_smf_track_begin(&iter, i);
+        uint64_t tick = 0;
+        const fmidi_event_t *event;
+        for (uint32_t index = 0; (event = fmidi_smf_track_next(smf, &iter)); ++index) {
+            tick += event->delta;
+            if (event->type != fmidi_event_message || event->datalen < 2)
+                continue;
+            uint8_t status = event->data[0] >> 4;
+            if (status == 0xb || status == 0xc || fmidi_change_resets(event))
+                changes.push_back(change{tick, (uint16_t)i, index, event});
+        }
+
+        bool last = i + 1 == ntracks;
+        if (shared && !last)
+            continue;
+
+        // in order of time, and of track at equal times
+        std::stable_sort(
+            changes.begin(), changes.end(),
+            [](const change &a, const change &b) { return a.tick < b.tick; });
+
+        const change *control[16][128] = {};
+        const change *program[16] = {};
+        bool bank[16] = {};  // bank selected since the program change
+        const change *select[16] = {};  // last parameter select, RPN or NRPN
+
+        for (size_t g = 0, n = changes.size(); g < n;) {
+            // a reset is unordered with the changes of other tracks at the
+            // same time, which cannot be repeats
+            // and so are the parameter selects of several tracks
+            int resettrack[16];  // -1 if none, -2 if several tracks
+            int selecttrack[16];
+            std::fill_n(resettrack, 16, -1);
+            std::fill_n(selecttrack, 16, -1);
+            size_t gend = g;
+            for (; gend < n && changes[gend].tick == changes[g].tick; ++gend) {
+                const change &chg = changes[gend];
+                unsigned resets = fmidi_change_resets(chg.event);
+                for (unsigned channel = 0; channel < 16; ++channel) {
+                    int &track = resettrack[channel];
+                    if (resets & (1u << channel))
+                        track = (track == -1 || track == chg.track) ? chg.track : -2;
+                }
+                if (fmidi_change_selects(chg.event)) {
+                    int &track = selecttrack[chg.event->data[0] & 15];
+                    track = (track == -1 || track == chg.track) ? chg.track : -2;
+                }
+            }
+
+            for (; g < gend; ++g) {
+                const change &chg = changes[g];
+                const fmidi_event_t *event = chg.event;
+                unsigned resets = fmidi_change_resets(event);
+                if (resets) {
+                    for (unsigned channel = 0; channel < 16; ++channel) {
+                        if (resets & (1u << channel)) {
+                            std::fill_n(control[channel], 128, nullptr);
+                            program[channel] = nullptr;
+                            bank[channel] = false;
+                            select[channel] = nullptr;
+                        }
+                    }
+                    continue;
+                }
+                unsigned channel = event->data[0] & 15;
+                bool ordered = resettrack[channel] == -1 ||
+                    resettrack[channel] == chg.track;
+                if ((event->data[0] >> 4) == 0xc) {
+                    const change *prev = program[channel];
+                    if (ordered && prev && !bank[channel] &&
+                        prev->event->data[1] == event->data[1] &&
+                        (prev->tick < chg.tick || prev->track == chg.track))
+                        repeats.insert(fmidi_repeat_key(chg.track, chg.index));
+                    else
+                        program[channel] = &chg;
+                    bank[channel] = false;
+                    continue;
+                }
+                if (event->datalen < 3)
+                    continue;
+                unsigned ctl = event->data[1];
+                // data entry acts each time
+                if (ctl == 6 || ctl == 38 || ctl == 96 || ctl == 97)
+                    continue;
+                // a parameter select also chooses between RPN and NRPN, so
+                // it repeats only if the previous select was of its kind
+                bool selects = fmidi_change_selects(event);
+                if (selects) {
+                    const change *last = select[channel];
+                    ordered = ordered && selecttrack[channel] == chg.track && last &&
+                        (ctl >= 100) == (last->event->data[1] >= 100);
+                }
+                const change *prev = control[channel][ctl];
+                if (ordered && prev && prev->event->data[2] == event->data[2] &&
+                    (prev->tick < chg.tick || prev->track == chg.track))
+                    repeats.insert(fmidi_repeat_key(chg.track, chg.index));
+                else {
+                    control[channel][ctl] = &chg;
+                    if (ctl == 0 || ctl == 32)
+                        bank[channel] = true;
+                    if (selects)
+                        select[channel] = &chg;
+                }
+            }
+        }
+
+        changes.clear();
+    }
+}
+
+static void fmidi_smf_encode_track(
+    const fmidi_smf_t *smf, unsigned i, Writer &writer, uint32_t flags,
+    const std::unordered_set<uint64_t> &repeats)
+{
+    const fmidi_raw_track &trk = smf->track[i];
+    if (trk.source && !(flags & fmidi_write_optimize)) {
+        // unmodified since read, copy the original encoding
+        writer.write(trk.source.get(), trk.sourcelength);
+        return;
+    }
+
+    int running_status = -1;
+    uint32_t carry = 0;  // delta of omitted events
+
+    fmidi_track_iter_t iter;
+    fmidi_smf_track_begin(&iter, i);
+
+    const fmidi_event_t *event;
+    for (uint32_t index = 0; (event = fmidi_smf_track_next(smf, &iter)); ++index) {
+        uint64_t delta = (uint64_t)event->delta + carry;
+        if (delta > 0x0fffffff) {
+            // beyond the range of VLQ, an empty text event takes the delta
+            // of the omitted events
+            write_vlq(carry, writer);
+            writer.put(0xff);
+            writer.put(0x01);
+            writer.put(0x00);
+            running_status = -1;
+            delta = event->delta;
+        }
+        bool omit =
+            ((flags & fmidi_write_drop_empty) && fmidi_event_empty(event)) ||
+            ((flags & fmidi_write_drop_repeats) &&
+             repeats.count(fmidi_repeat_key(i, index)));
+        if (omit) {
+            carry = delta;
+            continue;
+        }
+        carry = 0;
+
+        switch (event->type) {
+        case fmidi_event_meta:
+            write_vlq(delta, writer);
+            writer.put(0xff);
+            writer.put(event->data[0]);
+            write_vlq(event->datalen - 1, writer);
+            writer.write(event->data + 1, event->datalen - 1);
+            running_status = -1;
+            break;
+        case fmidi_event_message:
+        {
+            write_vlq(delta, writer);
+            uint8_t status = event->data[0];
+            const uint8_t *data = event->data + 1;
+            uint8_t noteon[2];
+            if ((flags & fmidi_write_note_off_as_on) &&
+                (status >> 4) == 0x8 && event->datalen == 3 && event->data[2] == 0x40) {
+                status = 0x90 | (status & 15);
+                noteon[0] = event->data[1];
+                noteon[1] = 0;
+                data = noteon;
+            }
+            if (status == 0xf0) {
+                writer.put(0xf0);
+                write_vlq(event->datalen - 1, writer);
+                writer.write(data, event->datalen - 1);
+                running_status = -1;
+            }
+            else if ((int)status == running_status)
+                writer.write(data, event->datalen - 1);
+            else {
+                writer.put(status);
+                writer.write(data, event->datalen - 1);
+                running_status = status;
+            }
+            break;
+        }
+        case fmidi_event_escape:
+            write_vlq(delta, writer);
+            writer.put(0xf7);
+            write_vlq(event->datalen, writer);
+            writer.write(event->data, event->datalen);
+            running_status = -1;
+            break;
+        case fmidi_event_xmi_timbre:
+        case fmidi_event_xmi_branch_point:
+            carry = delta;
+            break;
+        }
+    }
+}
+
+void fmidi_smf_write_track(const fmidi_smf_t *smf, unsigned i, Writer &writer)
+{
+    fmidi_smf_encode_track(smf, i, writer, 0, {});
+}
+
 static bool fmidi_smf_write(const fmidi_smf_t *smf, Writer &writer)
 {
     writer.write("MThd", 4);
@@ -35,6 +308,11 @@ static bool fmidi_smf_write(const fmidi_smf_t *smf, Writer &writer)
     writer.writeBE(&track_count, 2);
     writer.writeBE(&info->delta_unit, 2);
 
+    uint32_t flags = fmidi_write_opts.flags;
+    std::unordered_set<uint64_t> repeats;
+    if (flags & fmidi_write_drop_repeats)
+        fmidi_smf_find_repeats(smf, repeats);
+
     for (unsigned i = 0; i < track_count; ++i) {
         writer.write("MTrk", 4);
 
@@ -43,52 +321,7 @@ static bool fmidi_smf_write(const fmidi_smf_t *smf, Writer &writer)
         uint32_t track_length = 0;
         writer.writeBE(&track_length, 4);
 
-        int running_status = -1;
-
-        fmidi_track_iter_t iter;
-        fmidi_smf_track_begin(&iter, i);
-
-        const fmidi_event_t *event;
-        while ((event = fmidi_smf_track_next(smf, &iter))) {
-            switch (event->type) {
-            case fmidi_event_meta:
-                write_vlq(event->delta, writer);
-                writer.put(0xff);
-                writer.put(event->data[0]);
-                write_vlq(event->datalen - 1, writer);
-                writer.write(event->data + 1, event->datalen - 1);
-                running_status = -1;
-                break;
-            case fmidi_event_message:
-            {
-                write_vlq(event->delta, writer);
-                uint8_t status = event->data[0];
-                if (status == 0xf0) {
-                    writer.put(0xf0);
-                    write_vlq(event->datalen - 1, writer);
-                    writer.write(event->data + 1, event->datalen - 1);
-                    running_status = -1;
-                }
-                else if ((int)status == running_status)
-                    writer.write(event->data + 1, event->datalen - 1);
-                else {
-                    writer.write(event->data, event->datalen);
-                    running_status = status;
-                }
-                break;
-            }
-            case fmidi_event_escape:
-                write_vlq(event->delta, writer);
-                writer.put(0xf7);
-                write_vlq(event->datalen, writer);
-                writer.write(event->data, event->datalen);
-                running_status = -1;
-                break;
-            case fmidi_event_xmi_timbre:
-            case fmidi_event_xmi_branch_point:
-                break;
-            }
-        }
+        fmidi_smf_encode_track(smf, i, writer, flags, repeats);
 
         off_t off_track_end = writer.tell();
 
@@ -41,6 +41,11 @@ FMIDI_API fmidi_smf_t *fmidi_smf_file_read(const char *filename);
 FMIDI_API fmidi_smf_t *fmidi_smf_stream_read(FILE *stream);
 FMIDI_API void fmidi_smf_free(fmidi_smf_t *smf);
 
+// a song may be read from several threads at once, by the functions which
+// take it as const, and by sequencers and players of its own in each thread.
+// functions which take it as non-const need it to be used by no other thread
+// meanwhile. options and the last error are kept for each thread.
+
 typedef struct fmidi_smf_info {
     uint16_t format;
     uint16_t track_count;
@@ -58,6 +63,41 @@ FMIDI_API bool fmidi_smf_mem_write(const fmidi_smf_t *smf, uint8_t **data, size_
 FMIDI_API bool fmidi_smf_file_write(const fmidi_smf_t *smf, const char *filename);
 FMIDI_API bool fmidi_smf_stream_write(const fmidi_smf_t *smf, FILE *stream);
 
+/////////////
+// SHARING //
+/////////////
+
+// position-independent image, usable in place without parsing or copying.
+// a view refers to the image memory, which must outlive it and be aligned
+// to 8 bytes.
+FMIDI_API size_t fmidi_smf_image_size(const fmidi_smf_t *smf);
+FMIDI_API bool fmidi_smf_image_write(const fmidi_smf_t *smf, void *mem, size_t size);
+FMIDI_API fmidi_smf_t *fmidi_smf_image_view(const void *mem, size_t size);
+
+// image published in named POSIX shared memory, with read-only views.
+// views are reference counted across processes, the name is unlinked when
+// the last view is freed.
+FMIDI_API fmidi_smf_t *fmidi_smf_shm_publish(const fmidi_smf_t *smf, const char *name);
+FMIDI_API fmidi_smf_t *fmidi_smf_shm_open(const char *name);
+
+// pack of song images, in which identical tracks are stored once. the songs
+// of a pack share the storage of their common tracks, which stays alive
+// as long as the pack or one of its songs.
+typedef struct fmidi_pack fmidi_pack_t;
+
+FMIDI_API size_t fmidi_pack_size(const fmidi_smf_t *const *songs, size_t count);
+FMIDI_API bool fmidi_pack_write(
+    const fmidi_smf_t *const *songs, size_t count, void *mem, size_t size);
+FMIDI_API bool fmidi_pack_file_write(
+    const fmidi_smf_t *const *songs, size_t count, const char *filename);
+// a view refers to the pack memory, which must outlive it and its songs,
+// and be aligned to 8 bytes.
+FMIDI_API fmidi_pack_t *fmidi_pack_view(const void *mem, size_t size);
+FMIDI_API fmidi_pack_t *fmidi_pack_file_open(const char *filename);
+FMIDI_API void fmidi_pack_free(fmidi_pack_t *pack);
+FMIDI_API size_t fmidi_pack_song_count(const fmidi_pack_t *pack);
+FMIDI_API fmidi_smf_t *fmidi_pack_song(const fmidi_pack_t *pack, size_t index);
+
 ////////////////////
 // IDENTIFICATION //
 ////////////////////
@@ -110,6 +150,183 @@ FMIDI_API void fmidi_smf_track_begin(fmidi_track_iter_t *it, uint16_t track);
 FMIDI_API const fmidi_event_t *fmidi_smf_track_next(
     const fmidi_smf_t *smf, fmidi_track_iter_t *it);
 
+// random access within tracks, in logarithmic time if the song is indexed,
+// otherwise by a walk from the start of the track.
+FMIDI_API void fmidi_smf_build_index(fmidi_smf_t *smf);
+FMIDI_API const fmidi_event_t *fmidi_track_event_at(
+    const fmidi_smf_t *smf, uint16_t track, uint32_t number, uint64_t *tick);
+// position on the first event at or after the absolute time, and return the
+// time of this event, or the time of the end of the track if none.
+FMIDI_API uint64_t fmidi_track_seek_tick(
+    const fmidi_smf_t *smf, fmidi_track_iter_t *it, uint16_t track, uint64_t tick);
+
+//////////////
+// RESIDENT //
+//////////////
+
+// compact form of a song, which keeps its tracks as SMF data, with the
+// repairs of the reader applied and the running status local to each track.
+// events are decoded as they are iterated. XMI specific events are dropped.
+typedef struct fmidi_resident fmidi_resident_t;
+typedef struct fmidi_resident_iter fmidi_resident_iter_t;
+
+FMIDI_API fmidi_resident_t *fmidi_resident_new(const fmidi_smf_t *smf);
+FMIDI_API void fmidi_resident_free(fmidi_resident_t *res);
+FMIDI_API const fmidi_smf_info_t *fmidi_resident_get_info(const fmidi_resident_t *res);
+// memory held by the resident song, in bytes
+FMIDI_API size_t fmidi_resident_size(const fmidi_resident_t *res);
+// decode all the tracks into a song
+FMIDI_API fmidi_smf_t *fmidi_resident_load(const fmidi_resident_t *res);
+
+// the event returned is valid until the next call on the iterator
+FMIDI_API fmidi_resident_iter_t *fmidi_resident_iter_new(
+    const fmidi_resident_t *res, uint16_t track);
+FMIDI_API void fmidi_resident_iter_free(fmidi_resident_iter_t *it);
+FMIDI_API const fmidi_event_t *fmidi_resident_iter_next(fmidi_resident_iter_t *it);
+
+/////////////
+// EDITING //
+/////////////
+
+// replace the events of a track by a copy of the given ones. the track is
+// encoded anew when written, and the index of the song, if any, is dropped.
+FMIDI_API bool fmidi_smf_set_track(
+    fmidi_smf_t *smf, uint16_t track, const fmidi_event_t *const *events, size_t count);
+
+typedef enum fmidi_rounding {
+    fmidi_round_nearest,
+    fmidi_round_down,
+    fmidi_round_up,
+} fmidi_rounding_t;
+
+// change the delta unit, which is ticks per quarter note or SMPTE frames
+// and ticks per frame, and convert every delta. positions are converted as
+// absolute values, which does not accumulate rounding errors. between units
+// in quarter notes, they scale in ticks and keep their place in measures,
+// otherwise they keep their time. a delta longer than the file format
+// allows is split by empty text events, and a song which would be 2^40
+// ticks or longer is left as is with `fmidi_err_input`.
+FMIDI_API bool fmidi_smf_rescale(
+    fmidi_smf_t *smf, uint16_t unit, fmidi_rounding_t rounding);
+
+// extract the events in the time range [t0, t1) as a new song. the first
+// track starts with the events restoring the state at t0: system exclusive,
+// tempo, programs, controllers, parameters, pitch bend, pressure, time and
+// key signature. notes sounding at t1 are ended there, and tracks end at t1,
+// or earlier if the song does.
+FMIDI_API fmidi_smf_t *fmidi_smf_slice(const fmidi_smf_t *smf, double t0, double t1);
+
+typedef enum fmidi_concat_policy {
+    fmidi_concat_plain,
+    // between songs, silence the channels and return them to their state
+    // after reset, as each song expects to start with
+    fmidi_concat_reset,
+} fmidi_concat_policy_t;
+
+// append songs one after the other into a new song, with the given number
+// of seconds between each, if `gaps` is not null. track N of every song
+// continues track N of the result. the delta unit is common to all, in
+// which every tick of the songs exists if possible. songs of format 2 are
+// not accepted. long gaps are split as by `fmidi_smf_rescale`, which has
+// the same limit on the length of the result.
+FMIDI_API fmidi_smf_t *fmidi_smf_concat(
+    const fmidi_smf_t *const *smfs, size_t count, const double *gaps,
+    fmidi_concat_policy_t policy);
+
+/////////////
+// OPTIONS //
+/////////////
+
+typedef struct fmidi_intern_pool fmidi_intern_pool_t;
+
+// options of the readers, set for the calling thread. limits are 0 if unset.
+typedef struct fmidi_read_options {
+    uint32_t flags;
+    uint32_t event_limit;  // events read in a file
+    uint32_t sysex_limit;  // size of a system exclusive message
+    uint16_t track_limit;  // tracks in a file
+    // events to discard, by category and by a function returning false.
+    // the delta of a discarded event is carried over to the next one.
+    // end of track, tempo and SMPTE offset are always kept.
+    uint32_t filter;
+    bool (*filter_fn)(const fmidi_event_t *evt, void *data);
+    void *filter_data;
+    // data size above which events are stored apart from their track,
+    // which keeps the track compact for iteration.
+    uint32_t outline_limit;
+    // pool in which the events stored apart are shared, if not null
+    fmidi_intern_pool_t *intern_pool;
+} fmidi_read_options_t;
+
+enum {
+    // trust chunk lengths and fail on any deviation, without repairs.
+    // only for well-formed input, where it gives the same result faster.
+    fmidi_read_strict = 1 << 0,
+    // retain the encoded tracks, which the writers copy as is when they
+    // are not modified. not in effect for tracks which are filtered,
+    // repaired, which have any data after their end, or which start with
+    // the running status of a previous track.
+    fmidi_read_keep_source = 1 << 1,
+};
+
+enum {
+    fmidi_filter_notes = 1 << 0,  // note on, note off
+    fmidi_filter_pressure = 1 << 1,  // polyphonic and channel pressure
+    fmidi_filter_controls = 1 << 2,
+    fmidi_filter_programs = 1 << 3,
+    fmidi_filter_pitch_bend = 1 << 4,
+    fmidi_filter_sysex = 1 << 5,  // system messages and escapes
+    fmidi_filter_text = 1 << 6,  // meta events 01 to 0F
+    fmidi_filter_meta = 1 << 7,  // other meta events
+    fmidi_filter_xmi = 1 << 8,  // XMI timbres and branch points
+};
+
+FMIDI_API void fmidi_read_options_default(fmidi_read_options_t *opts);
+FMIDI_API const fmidi_read_options_t *fmidi_get_read_options();
+FMIDI_API void fmidi_set_read_options(const fmidi_read_options_t *opts);
+
+// options of the writers, set for the calling thread
+typedef struct fmidi_write_options {
+    uint32_t flags;
+} fmidi_write_options_t;
+
+enum {
+    // write note off as note on with velocity 0, which extends the runs of
+    // status. only for note off with the default release velocity of 64.
+    fmidi_write_note_off_as_on = 1 << 0,
+    // omit control and program changes which set the value in effect
+    fmidi_write_drop_repeats = 1 << 1,
+    // omit empty text and sequencer specific meta events, and empty system
+    // exclusive messages
+    fmidi_write_drop_empty = 1 << 2,
+    fmidi_write_optimize = fmidi_write_note_off_as_on |
+        fmidi_write_drop_repeats | fmidi_write_drop_empty,
+};
+
+FMIDI_API void fmidi_write_options_default(fmidi_write_options_t *opts);
+FMIDI_API const fmidi_write_options_t *fmidi_get_write_options();
+FMIDI_API void fmidi_set_write_options(const fmidi_write_options_t *opts);
+
+///////////////
+// INTERNING //
+///////////////
+
+// pool of events identical across songs, which readers store once when
+// given in the options. it may be shared by readers on several threads,
+// and it is freed with the last of the songs which refer to it.
+typedef struct fmidi_intern_stats {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t entries;
+    uint64_t stored_bytes;  // size of the distinct events
+    uint64_t saved_bytes;  // size of the duplicates not stored
+} fmidi_intern_stats_t;
+
+FMIDI_API fmidi_intern_pool_t *fmidi_intern_pool_new();
+FMIDI_API void fmidi_intern_pool_free(fmidi_intern_pool_t *pool);
+FMIDI_API void fmidi_intern_pool_stats(
+    const fmidi_intern_pool_t *pool, fmidi_intern_stats_t *stats);
+
 /////////////
 // FORMATS //
 /////////////
@@ -139,6 +356,175 @@ FMIDI_API void fmidi_seq_free(fmidi_seq_t *pl);
 FMIDI_API void fmidi_seq_rewind(fmidi_seq_t *pl);
 FMIDI_API bool fmidi_seq_peek_event(fmidi_seq_t *pl, fmidi_seq_event_t *plevt);
 FMIDI_API bool fmidi_seq_next_event(fmidi_seq_t *pl, fmidi_seq_event_t *plevt);
+// position before the first event at or after the time, or the tick. this
+// does not replay the events, and it takes logarithmic time if the song is
+// indexed. the first call builds the tempo map of the song.
+FMIDI_API void fmidi_seq_seek_time(fmidi_seq_t *seq, double time);
+FMIDI_API void fmidi_seq_seek_tick(fmidi_seq_t *seq, uint64_t tick);
+// step backward over the event before the position, which the next event
+// will be again. the first call builds the tempo map, and the index of the
+// song for this sequencer if the song has none.
+FMIDI_API bool fmidi_seq_prev_event(fmidi_seq_t *seq, fmidi_seq_event_t *sqevt);
+
+// copy of the sequencer in its current position. the tempo maps of a
+// sequencer which has been seeked are shared with the copy, not rebuilt.
+FMIDI_API fmidi_seq_t *fmidi_seq_clone(const fmidi_seq_t *seq);
+// position of the sequencer as plain data, in memory given by the caller.
+// the state is valid for the sequencers of the same song, in this process.
+FMIDI_API size_t fmidi_seq_state_size(const fmidi_seq_t *seq);
+FMIDI_API bool fmidi_seq_save_state(const fmidi_seq_t *seq, void *mem, size_t size);
+FMIDI_API bool fmidi_seq_restore_state(fmidi_seq_t *seq, const void *mem, size_t size);
+
+// tracks and channels left out of the sequence. events of tracks muted, or
+// not soloed when some are, are not returned. tracks which have none to
+// return leave the merge, except for their tempo changes. tracks returning
+// are brought to the current time. the sequence ends with the last event
+// of the tracks in the merge. masks are kept by clones, not by saved states.
+FMIDI_API void fmidi_seq_mute_track(fmidi_seq_t *seq, uint16_t track, bool mute);
+FMIDI_API void fmidi_seq_solo_track(fmidi_seq_t *seq, uint16_t track, bool solo);
+// bit set of the channels of the messages returned
+FMIDI_API void fmidi_seq_set_channel_mask(fmidi_seq_t *seq, uint16_t channels);
+
+/////////////
+// QUERIES //
+/////////////
+
+// the events of a song merged in playing order, for queries by time.
+// it refers to the events of the song, which must outlive it.
+typedef struct fmidi_timeline fmidi_timeline_t;
+
+typedef struct fmidi_query_filter {
+    uint32_t types;  // categories of event as filter flags, 0 for all
+    uint16_t channels;  // bit set of channels, 0 for all
+} fmidi_query_filter_t;
+
+typedef struct fmidi_span {
+    const fmidi_seq_event_t *events;
+    size_t count;
+} fmidi_span_t;
+
+FMIDI_API fmidi_timeline_t *fmidi_timeline_new(const fmidi_smf_t *smf);
+FMIDI_API void fmidi_timeline_free(fmidi_timeline_t *tl);
+FMIDI_API size_t fmidi_timeline_size(const fmidi_timeline_t *tl);
+// find the events in the time range [t0, t1) which pass the filter, if any.
+// they are returned as runs of consecutive events of the timeline. return
+// the number of runs, of which at most `max` are written. without a filter
+// it takes O(log n), and with one O(log n + k) for k events passing it.
+FMIDI_API size_t fmidi_query_range(
+    const fmidi_timeline_t *tl, double t0, double t1,
+    const fmidi_query_filter_t *filter, fmidi_span_t *out, size_t max);
+
+// the notes of a song paired from their on and off events, for queries of
+// overlap in time. unfinished notes end with the song.
+typedef struct fmidi_note_index fmidi_note_index_t;
+
+typedef struct fmidi_note {
+    double start;
+    double end;
+    uint16_t track;  // of the note on
+    uint8_t channel;
+    uint8_t key;
+    uint8_t velocity;
+} fmidi_note_t;
+
+FMIDI_API fmidi_note_index_t *fmidi_note_index_new(const fmidi_smf_t *smf);
+FMIDI_API void fmidi_note_index_free(fmidi_note_index_t *ni);
+FMIDI_API size_t fmidi_note_index_size(const fmidi_note_index_t *ni);
+// find the notes which sound at the time, or which sound within the time
+// range [t0, t1) with a key in the range [keymin, keymax]. return the
+// number of notes, of which at most `max` are written.
+FMIDI_API size_t fmidi_notes_at(
+    const fmidi_note_index_t *ni, double time, fmidi_note_t *out, size_t max);
+FMIDI_API size_t fmidi_notes_overlapping(
+    const fmidi_note_index_t *ni, double t0, double t1,
+    unsigned keymin, unsigned keymax, fmidi_note_t *out, size_t max);
+
+// counts of notes over time, per track and channel, at resolutions from a
+// bucket of ticks up to the whole song, each level doubling the previous.
+typedef struct fmidi_density fmidi_density_t;
+
+typedef struct fmidi_density_lane {
+    uint16_t track;
+    uint8_t channel;
+} fmidi_density_lane_t;
+
+typedef struct fmidi_density_cell {
+    uint32_t notes;  // notes started
+    uint32_t voices;  // most notes sounding at once
+} fmidi_density_cell_t;
+
+// the bucket is raised as needed to bound the memory, on a long song with
+// many lanes. null with `fmidi_err_limit` if the memory cannot be had.
+FMIDI_API fmidi_density_t *fmidi_density_new(const fmidi_smf_t *smf, uint32_t bucket);
+FMIDI_API void fmidi_density_free(fmidi_density_t *dens);
+FMIDI_API uint32_t fmidi_density_bucket(const fmidi_density_t *dens);
+FMIDI_API unsigned fmidi_density_lane_count(const fmidi_density_t *dens);
+FMIDI_API fmidi_density_lane_t fmidi_density_lane(const fmidi_density_t *dens, unsigned lane);
+// summarize a lane over [tick0, tick1) into a number of equal cells, from
+// the coarsest level which is still finer than a cell.
+FMIDI_API void fmidi_density_query(
+    const fmidi_density_t *dens, unsigned lane, uint64_t tick0, uint64_t tick1,
+    fmidi_density_cell_t *cells, unsigned count);
+// serialize to memory, and read back
+FMIDI_API size_t fmidi_density_image_size(const fmidi_density_t *dens);
+FMIDI_API bool fmidi_density_image_write(
+    const fmidi_density_t *dens, void *mem, size_t size);
+FMIDI_API fmidi_density_t *fmidi_density_image_read(const void *mem, size_t size);
+
+// the text meta events of a song (lyrics, markers, cue points...), in
+// playing order, with a copy of their text.
+typedef struct fmidi_text_index fmidi_text_index_t;
+
+typedef struct fmidi_text_entry {
+    uint64_t tick;
+    double time;
+    uint16_t track;
+    uint8_t type;  // of meta event, 01 to 0F
+    const char *text;  // zero-terminated
+    uint32_t length;
+} fmidi_text_entry_t;
+
+FMIDI_API fmidi_text_index_t *fmidi_text_index_new(const fmidi_smf_t *smf);
+FMIDI_API void fmidi_text_index_free(fmidi_text_index_t *ti);
+FMIDI_API size_t fmidi_text_index_size(const fmidi_text_index_t *ti);
+FMIDI_API const fmidi_text_entry_t *fmidi_text_entry(const fmidi_text_index_t *ti, size_t index);
+// find the last entry at or before the time, or the first entry after the
+// time, among the types of the mask, which has bit n set for type n.
+FMIDI_API const fmidi_text_entry_t *fmidi_text_at_time(
+    const fmidi_text_index_t *ti, double time, uint32_t types);
+FMIDI_API const fmidi_text_entry_t *fmidi_text_after_time(
+    const fmidi_text_index_t *ti, double time, uint32_t types);
+
+///////////
+// METER //
+///////////
+
+// the time signatures and the tempos of a song in metrical time, for the
+// conversion of positions between ticks, seconds, and bars. in format 2,
+// it is the map of the first track.
+typedef struct fmidi_meter_map fmidi_meter_map_t;
+
+// position in bars, in beats of the time signature, and in ticks, counting
+// from zero
+typedef struct fmidi_bbt {
+    uint32_t bar;
+    uint32_t beat;
+    uint32_t tick;
+} fmidi_bbt_t;
+
+FMIDI_API fmidi_meter_map_t *fmidi_meter_map_new(const fmidi_smf_t *smf);
+FMIDI_API void fmidi_meter_map_free(fmidi_meter_map_t *map);
+FMIDI_API double fmidi_meter_tick_to_time(const fmidi_meter_map_t *map, double tick);
+FMIDI_API double fmidi_meter_time_to_tick(const fmidi_meter_map_t *map, double time);
+FMIDI_API fmidi_bbt_t fmidi_meter_tick_to_bbt(const fmidi_meter_map_t *map, uint64_t tick);
+FMIDI_API uint64_t fmidi_meter_bbt_to_tick(const fmidi_meter_map_t *map, fmidi_bbt_t bbt);
+// conversions of arrays, in linear time if the positions are sorted
+FMIDI_API void fmidi_meter_ticks_to_times(
+    const fmidi_meter_map_t *map, const uint64_t *ticks, double *times, size_t count);
+FMIDI_API void fmidi_meter_times_to_ticks(
+    const fmidi_meter_map_t *map, const double *times, double *ticks, size_t count);
+FMIDI_API void fmidi_meter_ticks_to_bbt(
+    const fmidi_meter_map_t *map, const uint64_t *ticks, fmidi_bbt_t *bbt, size_t count);
 
 /////////////
 // UTILITY //
@@ -162,7 +548,8 @@ typedef enum fmidi_status {
     fmidi_err_eof,
     fmidi_err_input,
     fmidi_err_largefile,
-    fmidi_err_output
+    fmidi_err_output,
+    fmidi_err_limit
 } fmidi_status_t;
 
 FMIDI_API fmidi_status_t fmidi_errno();
@@ -182,7 +569,7 @@ FMIDI_API const fmidi_error_info_t *fmidi_errinfo();
 ////////////
 
 typedef struct fmidi_player fmidi_player_t;
-FMIDI_API fmidi_player_t *fmidi_player_new(fmidi_smf_t *smf);
+FMIDI_API fmidi_player_t *fmidi_player_new(const fmidi_smf_t *smf);
 FMIDI_API void fmidi_player_tick(fmidi_player_t *seq, double delta);
 FMIDI_API void fmidi_player_free(fmidi_player_t *seq);
 FMIDI_API void fmidi_player_start(fmidi_player_t *seq);
@@ -197,6 +584,11 @@ FMIDI_API void fmidi_player_event_callback(
     fmidi_player_t *seq, void (*cbfn)(const fmidi_event_t *, void *), void *cbdata);
 FMIDI_API void fmidi_player_finish_callback(
     fmidi_player_t *seq, void (*cbfn)(void *), void *cbdata);
+// masks of the sequencer, see above. notes sounding in the tracks and the
+// channels which are muted are not ended.
+FMIDI_API void fmidi_player_mute_track(fmidi_player_t *seq, uint16_t track, bool mute);
+FMIDI_API void fmidi_player_solo_track(fmidi_player_t *seq, uint16_t track, bool solo);
+FMIDI_API void fmidi_player_set_channel_mask(fmidi_player_t *seq, uint16_t channels);
 
 //////////////
 // PRINTERS //
@@ -236,14 +628,41 @@ FMIDI_API std::ostream &operator<<(std::ostream &out, const fmidi_event_t &evt);
 
 struct fmidi_smf_deleter {
     void operator()(fmidi_smf_t *x) const { fmidi_smf_free(x); } };
+struct fmidi_pack_deleter {
+    void operator()(fmidi_pack_t *x) const { fmidi_pack_free(x); } };
 struct fmidi_seq_deleter {
     void operator()(fmidi_seq_t *x) const { fmidi_seq_free(x); } };
 struct fmidi_player_deleter {
     void operator()(fmidi_player_t *x) const { fmidi_player_free(x); } };
+struct fmidi_timeline_deleter {
+    void operator()(fmidi_timeline_t *x) const { fmidi_timeline_free(x); } };
+struct fmidi_note_index_deleter {
+    void operator()(fmidi_note_index_t *x) const { fmidi_note_index_free(x); } };
+struct fmidi_density_deleter {
+    void operator()(fmidi_density_t *x) const { fmidi_density_free(x); } };
+struct fmidi_text_index_deleter {
+    void operator()(fmidi_text_index_t *x) const { fmidi_text_index_free(x); } };
+struct fmidi_meter_map_deleter {
+    void operator()(fmidi_meter_map_t *x) const { fmidi_meter_map_free(x); } };
+struct fmidi_intern_pool_deleter {
+    void operator()(fmidi_intern_pool_t *x) const { fmidi_intern_pool_free(x); } };
+struct fmidi_resident_deleter {
+    void operator()(fmidi_resident_t *x) const { fmidi_resident_free(x); } };
+struct fmidi_resident_iter_deleter {
+    void operator()(fmidi_resident_iter_t *x) const { fmidi_resident_iter_free(x); } };
 
 typedef std::unique_ptr<fmidi_smf_t, fmidi_smf_deleter> fmidi_smf_u;
+typedef std::unique_ptr<fmidi_pack_t, fmidi_pack_deleter> fmidi_pack_u;
 typedef std::unique_ptr<fmidi_seq_t, fmidi_seq_deleter> fmidi_seq_u;
 typedef std::unique_ptr<fmidi_player_t, fmidi_player_deleter> fmidi_player_u;
+typedef std::unique_ptr<fmidi_timeline_t, fmidi_timeline_deleter> fmidi_timeline_u;
+typedef std::unique_ptr<fmidi_note_index_t, fmidi_note_index_deleter> fmidi_note_index_u;
+typedef std::unique_ptr<fmidi_density_t, fmidi_density_deleter> fmidi_density_u;
+typedef std::unique_ptr<fmidi_text_index_t, fmidi_text_index_deleter> fmidi_text_index_u;
+typedef std::unique_ptr<fmidi_meter_map_t, fmidi_meter_map_deleter> fmidi_meter_map_u;
+typedef std::unique_ptr<fmidi_intern_pool_t, fmidi_intern_pool_deleter> fmidi_intern_pool_u;
+typedef std::unique_ptr<fmidi_resident_t, fmidi_resident_deleter> fmidi_resident_u;
+typedef std::unique_ptr<fmidi_resident_iter_t, fmidi_resident_iter_deleter> fmidi_resident_iter_u;
 #endif
 
 ////////////////
@@ -0,0 +1,398 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "fmidi/fmidi_chase.h"
+#include <algorithm>
+#include <string.h>
+
+static const fmidi_chase_rpn fmidi_chase_default_rpn[] = {
+    {0x0000, 2, 0},  // pitch bend sensitivity
+    {0x0001, 64, 0},  // fine tuning
+    {0x0002, 64, 0},  // coarse tuning
+};
+
+static void fmidi_chase_reset_controllers(fmidi_chase_channel &ch)
+{
+    // as per RP-015
+    ch.controls[1] = 0;
+    ch.controls[11] = 127;
+    std::fill_n(&ch.controls[64], 4, 0);
+    std::fill_n(&ch.controls[98], 4, 127);
+    ch.nrpn = false;
+    ch.bend = 8192;
+    ch.pressure = 0;
+}
+
+static void fmidi_chase_reset_channel(fmidi_chase_channel &ch)
+{
+    ch.program = 0;
+    std::fill_n(ch.controls, 128, 0);
+    ch.controls[7] = 100;
+    ch.controls[8] = 64;
+    ch.controls[10] = 64;
+    fmidi_chase_reset_controllers(ch);
+    memset(ch.notes, 0, sizeof(ch.notes));
+    ch.rpn.assign(std::begin(fmidi_chase_default_rpn),
+                  std::end(fmidi_chase_default_rpn));
+}
+
+enum { fmidi_chase_sysex_limit = 256 };
+
+void fmidi_chase_reset(fmidi_chase_state &st)
+{
+    for (fmidi_chase_channel &ch : st.channel)
+        fmidi_chase_reset_channel(ch);
+    st.tempo = 500000;
+    st.sysex.clear();
+}
+
+void fmidi_chase_forget(fmidi_chase_state &st)
+{
+    for (fmidi_chase_channel &ch : st.channel) {
+        ch.program = 255;
+        std::fill_n(ch.controls, 128, 255);
+        ch.bend = 0xffff;
+        ch.pressure = 255;
+        ch.nrpn = false;
+        // anything can be sounding
+        memset(ch.notes, 0xff, sizeof(ch.notes));
+        ch.rpn.clear();
+    }
+    st.tempo = 0;
+    st.sysex.clear();
+}
+
+bool fmidi_chase_is_reset_sysex(const uint8_t *msg, uint32_t len)
+{
+    // GM system on, GM2 system on
+    if (len >= 6 && msg[1] == 0x7e && msg[3] == 0x09 &&
+        (msg[4] == 0x01 || msg[4] == 0x03))
+        return true;
+    // GS reset
+    if (len >= 11 && msg[1] == 0x41 && msg[3] == 0x42 && msg[4] == 0x12 &&
+        msg[5] == 0x40 && msg[6] == 0x00 && msg[7] == 0x7f)
+        return true;
+    // XG system on
+    if (len >= 9 && msg[1] == 0x43 && (msg[2] & 0xf0) == 0x10 &&
+        msg[3] == 0x4c && msg[4] == 0x00 && msg[5] == 0x00 && msg[6] == 0x7e)
+        return true;
+    return false;
+}
+
+static int fmidi_chase_selected_param(const fmidi_chase_channel &ch)
+{
+    unsigned idmsb = ch.nrpn ? 99 : 101;
+    unsigned idlsb = ch.nrpn ? 98 : 100;
+    if (ch.controls[idmsb] > 127 || ch.controls[idlsb] > 127)
+        return -1;  // unknown
+    bool nrpn = ch.controls[99] != 127 || ch.controls[98] != 127;
+    bool rpn = ch.controls[101] != 127 || ch.controls[100] != 127;
+    if (ch.nrpn) {
+        if (!nrpn)
+            return -1;
+        return (1 << 14) | (ch.controls[99] << 7) | ch.controls[98];
+    }
+    else {
+        if (!rpn)
+            return -1;
+        return (ch.controls[101] << 7) | ch.controls[100];
+    }
+}
+
+static fmidi_chase_rpn *fmidi_chase_find_param(
+    std::vector<fmidi_chase_rpn> &rpn, unsigned param)
+{
+    for (fmidi_chase_rpn &entry : rpn)
+        if (entry.param == param)
+            return &entry;
+    return nullptr;
+}
+
+static const fmidi_chase_rpn *fmidi_chase_find_param(
+    const std::vector<fmidi_chase_rpn> &rpn, unsigned param)
+{
+    for (const fmidi_chase_rpn &entry : rpn)
+        if (entry.param == param)
+            return &entry;
+    return nullptr;
+}
+
+static void fmidi_chase_control(
+    fmidi_chase_channel &ch, unsigned id, unsigned value)
+{
+    switch (id) {
+    case 6: case 38: {  // data entry MSB, LSB
+        int param = fmidi_chase_selected_param(ch);
+        if (param == -1)
+            break;
+        fmidi_chase_rpn *entry = fmidi_chase_find_param(ch.rpn, param);
+        if (!entry) {
+            ch.rpn.push_back(fmidi_chase_rpn{(uint16_t)param, 0, 0});
+            entry = &ch.rpn.back();
+        }
+        (id == 6) ? (entry->msb = value) : (entry->lsb = value);
+        break;
+    }
+    case 96: case 97:  // data increment, decrement
+        // not chased
+        break;
+    case 98: case 99:  // NRPN LSB, MSB
+        ch.controls[id] = value;
+        ch.nrpn = true;
+        break;
+    case 100: case 101:  // RPN LSB, MSB
+        ch.controls[id] = value;
+        ch.nrpn = false;
+        break;
+    case 120: case 123: case 124: case 125: case 126: case 127:
+        // all sound off, all notes off, and mode changes
+        memset(ch.notes, 0, sizeof(ch.notes));
+        break;
+    case 121:  // reset all controllers
+        fmidi_chase_reset_controllers(ch);
+        break;
+    case 122:  // local control
+        break;
+    default:
+        ch.controls[id] = value;
+        break;
+    }
+}
+
+void fmidi_chase_update(fmidi_chase_state &st, const fmidi_event_t &evt)
+{
+    const uint8_t *data = evt.data;
+    uint32_t datalen = evt.datalen;
+
+    if (evt.type == fmidi_event_meta) {
+        if (data[0] == 0x51 && datalen == 4) {  // set tempo
+            const uint8_t *d24 = &data[1];
+            st.tempo = (d24[0] << 16) | (d24[1] << 8) | d24[2];
+        }
+        return;
+    }
+
+    if (evt.type != fmidi_event_message || datalen < 1)
+        return;
+
+    unsigned status = data[0];
+    if (status == 0xf0) {
+        if (fmidi_chase_is_reset_sysex(data, datalen)) {
+            for (fmidi_chase_channel &ch : st.channel)
+                fmidi_chase_reset_channel(ch);
+            st.sysex.clear();
+        }
+        // drop the older half when full, which the sink and the target do
+        // at the same point of the same history
+        if (st.sysex.size() == fmidi_chase_sysex_limit)
+            st.sysex.erase(st.sysex.begin(), st.sysex.begin() + fmidi_chase_sysex_limit / 2);
+        st.sysex.push_back(&evt);
+        return;
+    }
+
+    fmidi_chase_channel &ch = st.channel[status & 0xf];
+    switch (status >> 4) {
+    case 0b1000:  // note off
+        if (datalen == 3) {
+            unsigned key = data[1] & 127;
+            ch.notes[key >> 3] &= ~(1u << (key & 7));
+        }
+        break;
+    case 0b1001:  // note on
+        if (datalen == 3) {
+            unsigned key = data[1] & 127;
+            if (data[2] & 127)
+                ch.notes[key >> 3] |= 1u << (key & 7);
+            else
+                ch.notes[key >> 3] &= ~(1u << (key & 7));
+        }
+        break;
+    case 0b1011:  // control change
+        if (datalen == 3)
+            fmidi_chase_control(ch, data[1] & 127, data[2] & 127);
+        break;
+    case 0b1100:  // program change
+        if (datalen == 2)
+            ch.program = data[1] & 127;
+        break;
+    case 0b1101:  // channel pressure
+        if (datalen == 2)
+            ch.pressure = data[1] & 127;
+        break;
+    case 0b1110:  // pitch bend
+        if (datalen == 3)
+            ch.bend = (data[1] & 127) | ((data[2] & 127) << 7);
+        break;
+    }
+}
+
+//------------------------------------------------------------------------------
+namespace {
+struct fmidi_chase_emitter {
+    fmidi_chase_state &sink;
+    fmidi_chase_emit_fn *fn;
+    void *data;
+    void event(const fmidi_event_t &evt);
+    void message(uint8_t status, uint8_t d1);
+    void message(uint8_t status, uint8_t d1, uint8_t d2);
+    void select(unsigned channel, unsigned param);
+    void control(unsigned channel, unsigned id, unsigned value);
+};
+}
+
+void fmidi_chase_emitter::event(const fmidi_event_t &evt)
+{
+    fn(&evt, data);
+    fmidi_chase_update(sink, evt);
+}
+
+void fmidi_chase_emitter::message(uint8_t status, uint8_t d1)
+{
+    uint8_t evtbuf[fmidi_event_sizeof(2)];
+    fmidi_event_t *evt = (fmidi_event_t *)evtbuf;
+    evt->type = fmidi_event_message;
+    evt->delta = 0;
+    evt->datalen = 2;
+    evt->data[0] = status;
+    evt->data[1] = d1;
+    event(*evt);
+}
+
+void fmidi_chase_emitter::message(uint8_t status, uint8_t d1, uint8_t d2)
+{
+    uint8_t evtbuf[fmidi_event_sizeof(3)];
+    fmidi_event_t *evt = (fmidi_event_t *)evtbuf;
+    evt->type = fmidi_event_message;
+    evt->delta = 0;
+    evt->datalen = 3;
+    evt->data[0] = status;
+    evt->data[1] = d1;
+    evt->data[2] = d2;
+    event(*evt);
+}
+
+void fmidi_chase_emitter::control(unsigned channel, unsigned id, unsigned value)
+{
+    if (sink.channel[channel].controls[id] != value)
+        message((0b1011 << 4) | channel, id, value);
+}
+
+void fmidi_chase_emitter::select(unsigned channel, unsigned param)
+{
+    const fmidi_chase_channel &ch = sink.channel[channel];
+    bool nrpn = param & (1 << 14);
+    unsigned msb = (param >> 7) & 127;
+    unsigned lsb = param & 127;
+    unsigned idmsb = nrpn ? 99 : 101;
+    unsigned idlsb = nrpn ? 98 : 100;
+
+    control(channel, idmsb, msb);
+    // resend if needed so the selection kind becomes the one expected
+    if (ch.nrpn != nrpn)
+        message((0b1011 << 4) | channel, idlsb, lsb);
+    else
+        control(channel, idlsb, lsb);
+}
+
+void fmidi_chase_emit(
+    fmidi_chase_state &sink, const fmidi_chase_state &target,
+    fmidi_chase_emit_fn *fn, void *data)
+{
+    fmidi_chase_emitter emitter{sink, fn, data};
+
+    // system exclusive, replayed from the point the histories diverge
+    auto same_sysex = [](const fmidi_event_t *a, const fmidi_event_t *b) -> bool {
+        return a->datalen == b->datalen && !memcmp(a->data, b->data, a->datalen); };
+    size_t nsent = sink.sysex.size();
+    size_t ntarget = target.sysex.size();
+    size_t start = 0;
+    if (nsent <= ntarget && std::equal(
+            sink.sysex.begin(), sink.sysex.end(), target.sysex.begin(), same_sysex))
+        start = nsent;
+    else
+        sink.sysex.clear();
+    for (size_t i = start; i < ntarget; ++i)
+        emitter.event(*target.sysex[i]);
+
+    // tempo
+    if (sink.tempo != target.tempo) {
+        uint8_t evtbuf[fmidi_event_sizeof(4)];
+        fmidi_event_t *evt = (fmidi_event_t *)evtbuf;
+        evt->type = fmidi_event_meta;
+        evt->delta = 0;
+        evt->datalen = 4;
+        evt->data[0] = 0x51;
+        evt->data[1] = target.tempo >> 16;
+        evt->data[2] = target.tempo >> 8;
+        evt->data[3] = target.tempo;
+        emitter.event(*evt);
+    }
+
+    for (unsigned c = 0; c < 16; ++c) {
+        const fmidi_chase_channel &to = target.channel[c];
+        const fmidi_chase_channel &from = sink.channel[c];
+
+        // sound off, if anything can be sounding
+        bool sounding = from.controls[64] >= 64 || from.controls[66] >= 64;
+        for (unsigned i = 0; i < 16 && !sounding; ++i)
+            sounding = from.notes[i] != 0;
+        if (sounding)
+            emitter.message((0b1011 << 4) | c, 120, 0);
+
+        // bank select before program change
+        bool bank = from.controls[0] != to.controls[0] ||
+            from.controls[32] != to.controls[32];
+        emitter.control(c, 0, to.controls[0]);
+        emitter.control(c, 32, to.controls[32]);
+        if (bank || from.program != to.program)
+            emitter.message((0b1100 << 4) | c, to.program);
+
+        // controllers
+        for (unsigned id = 1; id < 120; ++id) {
+            switch (id) {
+            case 6: case 32: case 38: case 96: case 97:
+            case 98: case 99: case 100: case 101:
+                break;
+            default:
+                emitter.control(c, id, to.controls[id]);
+                break;
+            }
+        }
+
+        // registered and non-registered parameters, selection before data
+        for (const fmidi_chase_rpn &entry : to.rpn) {
+            const fmidi_chase_rpn *cur = fmidi_chase_find_param(from.rpn, entry.param);
+            bool msbdiff = !cur || cur->msb != entry.msb;
+            bool lsbdiff = !cur || cur->lsb != entry.lsb;
+            if (!msbdiff && !lsbdiff)
+                continue;
+            emitter.select(c, entry.param);
+            if (msbdiff)
+                emitter.message((0b1011 << 4) | c, 6, entry.msb);
+            if (lsbdiff)
+                emitter.message((0b1011 << 4) | c, 38, entry.lsb);
+        }
+
+        // parameter selection
+        unsigned rpnsel = (to.controls[101] << 7) | to.controls[100];
+        unsigned nrpnsel = (1 << 14) | (to.controls[99] << 7) | to.controls[98];
+        if (to.nrpn) {
+            emitter.control(c, 101, to.controls[101]);
+            emitter.control(c, 100, to.controls[100]);
+            emitter.select(c, nrpnsel);
+        }
+        else {
+            emitter.control(c, 99, to.controls[99]);
+            emitter.control(c, 98, to.controls[98]);
+            emitter.select(c, rpnsel);
+        }
+
+        // pitch bend and pressure
+        if (from.bend != to.bend)
+            emitter.message((0b1110 << 4) | c, to.bend & 127, to.bend >> 7);
+        if (from.pressure != to.pressure)
+            emitter.message((0b1101 << 4) | c, to.pressure);
+    }
+}
@@ -0,0 +1,52 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include "fmidi/fmidi.h"
+#include <vector>
+
+// Model of the state held by a MIDI receiver, used to chase after a seek.
+// The model starts in the state of a device after a GM reset, or in a state
+// unknown, where every value is out of range until the receiver is sent one.
+// The system exclusive history keeps the latest messages since the last
+// reset, up to a limit.
+
+struct fmidi_chase_rpn {
+    uint16_t param;  // 14-bit parameter number, bit 14 set if NRPN
+    uint8_t msb;
+    uint8_t lsb;
+};
+
+struct fmidi_chase_channel {
+    uint8_t program;
+    uint8_t controls[128];
+    uint16_t bend;
+    uint8_t pressure;
+    bool nrpn;  // whether the last parameter selection is non-registered
+    uint8_t notes[16];  // bit set of sounding notes
+    std::vector<fmidi_chase_rpn> rpn;
+};
+
+struct fmidi_chase_state {
+    fmidi_chase_channel channel[16];
+    uint32_t tempo;
+    std::vector<const fmidi_event_t *> sysex;
+};
+
+typedef void (fmidi_chase_emit_fn)(const fmidi_event_t *, void *);
+
+void fmidi_chase_reset(fmidi_chase_state &st);
+void fmidi_chase_forget(fmidi_chase_state &st);
+void fmidi_chase_update(fmidi_chase_state &st, const fmidi_event_t &evt);
+
+// whether the system exclusive message is a GM, GS or XG reset
+bool fmidi_chase_is_reset_sysex(const uint8_t *msg, uint32_t len);
+
+// emit the minimal sequence of events bringing the receiver from the state
+// `sink` to the state `target`, and update `sink` accordingly.
+// sounding notes are silenced, and notes of the target are disregarded.
+void fmidi_chase_emit(
+    fmidi_chase_state &sink, const fmidi_chase_state &target,
+    fmidi_chase_emit_fn *fn, void *data);
@@ -0,0 +1,369 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
+#include "fmidi/fmidi_internal.h"
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <vector>
+#include <math.h>
+#include <string.h>
+
+// The cells of all levels of a lane follow each other, the finest level
+// first. Level n has buckets of `bucket << n` ticks. The bucket is raised
+// when needed to keep the cells of all lanes within the limit.
+enum { fmidi_density_cell_limit = 1 << 24 };
+
+struct fmidi_density {
+    uint32_t bucket;
+    std::vector<fmidi_density_lane_t> lanes;
+    std::vector<size_t> levels;  // offset of each level within a lane
+    size_t lanesize = 0;  // cells of all levels of a lane
+    std::vector<fmidi_density_cell_t> cells;
+};
+
+struct fmidi_density_track {
+    uint64_t length = 0;  // ticks
+    unsigned channels = 0;  // mask of the channels which have notes
+    std::vector<fmidi_density_cell_t> channel[16];  // finest level
+};
+
+static bool fmidi_density_is_note(const fmidi_event_t *evt)
+{
+    if (evt->type != fmidi_event_message || evt->datalen != 3)
+        return false;
+    unsigned status = evt->data[0] >> 4;
+    return status == 0x8 || status == 0x9;
+}
+
+static void fmidi_density_track_scan(
+    const fmidi_smf_t *smf, uint16_t trkno, fmidi_density_track &dt)
+{
+    const fmidi_event_t *evt;
+    fmidi_track_iter_t it;
+    fmidi_smf_track_begin(&it, trkno);
+    uint64_t tick = 0;
+    while ((evt = fmidi_smf_track_next(smf, &it))) {
+        tick += evt->delta;
+        if (fmidi_density_is_note(evt))
+            dt.channels |= 1u << (evt->data[0] & 15);
+    }
+    dt.length = tick;
+}
+
+static void fmidi_density_track_build(
+    const fmidi_smf_t *smf, uint16_t trkno, uint32_t bucket,
+    fmidi_density_track &dt)
+{
+    // sounding notes on each channel and key, and in total on each channel
+    uint32_t sounding[16][128] = {};
+    uint32_t voices[16] = {};
+    // the bucket up to which a channel is filled with its voices
+    uint64_t filled[16] = {};
+
+    auto fill = [&dt, &voices, &filled](unsigned ch, uint64_t b) {
+        std::vector<fmidi_density_cell_t> &cells = dt.channel[ch];
+        if (cells.size() <= b)
+            cells.resize(b + 1, fmidi_density_cell_t{0, 0});
+        for (uint64_t i = filled[ch]; i <= b; ++i)
+            cells[i].voices = std::max(cells[i].voices, voices[ch]);
+        filled[ch] = b;
+    };
+
+    const fmidi_event_t *evt;
+    fmidi_track_iter_t it;
+    fmidi_smf_track_begin(&it, trkno);
+    uint64_t tick = 0;
+    while ((evt = fmidi_smf_track_next(smf, &it))) {
+        tick += evt->delta;
+        if (!fmidi_density_is_note(evt))
+            continue;
+
+        unsigned status = evt->data[0] >> 4;
+        unsigned ch = evt->data[0] & 15;
+        unsigned key = evt->data[1] & 127;
+        uint64_t b = tick / bucket;
+        fill(ch, b);
+
+        fmidi_density_cell_t &cell = dt.channel[ch][b];
+        if (status == 0x9 && evt->data[2] != 0) {
+            ++cell.notes;
+            ++sounding[ch][key];
+            ++voices[ch];
+            cell.voices = std::max(cell.voices, voices[ch]);
+        }
+        else if (sounding[ch][key] > 0) {
+            --sounding[ch][key];
+            --voices[ch];
+        }
+    }
+
+    for (unsigned ch = 0; ch < 16; ++ch) {
+        if (!dt.channel[ch].empty())
+            fill(ch, tick / bucket);
+    }
+}
+
+static fmidi_density_t *fmidi_density_create(const fmidi_smf_t *smf, uint32_t bucket)
+{
+    bucket = std::max(bucket, 1u);
+
+    unsigned ntracks = smf->info.track_count;
+    std::unique_ptr<fmidi_density_track[]> tracks(new fmidi_density_track[ntracks]);
+    fmidi_parallel_for(ntracks, [smf, &tracks](unsigned i) {
+        fmidi_density_track_scan(smf, i, tracks[i]);
+    });
+
+    uint64_t length = 0;
+    uint64_t lanecount = 0;
+    for (unsigned i = 0; i < ntracks; ++i) {
+        length = std::max(length, tracks[i].length);
+        for (unsigned ch = 0; ch < 16; ++ch)
+            lanecount += (tracks[i].channels >> ch) & 1;
+    }
+
+    // a lane has less than twice its finest buckets over all levels
+    uint64_t maxbuckets = fmidi_density_cell_limit / (2 * std::max<uint64_t>(lanecount, 1));
+    if (maxbuckets == 0)
+        RET_FAIL(nullptr, fmidi_err_limit);
+    uint64_t minbucket = length / maxbuckets + 1;
+    if (minbucket > UINT32_MAX)
+        RET_FAIL(nullptr, fmidi_err_limit);
+    bucket = std::max<uint64_t>(bucket, minbucket);
+
+    std::atomic<bool> failed(false);
+    fmidi_parallel_for(ntracks, [smf, bucket, &tracks, &failed](unsigned i) {
+        try {
+            fmidi_density_track_build(smf, i, bucket, tracks[i]);
+        }
+        catch (std::bad_alloc &) {
+            failed = true;
+        }
+    });
+    if (failed)
+        RET_FAIL(nullptr, fmidi_err_limit);
+
+    std::unique_ptr<fmidi_density_t> dens(new fmidi_density_t);
+    dens->bucket = bucket;
+
+    // levels halving down to a single bucket
+    size_t nbuckets = length / bucket + 1;
+    for (size_t n = nbuckets;; n = (n + 1) / 2) {
+        dens->levels.push_back(dens->lanesize);
+        dens->lanesize += n;
+        if (n == 1)
+            break;
+    }
+
+    for (unsigned i = 0; i < ntracks; ++i) {
+        for (unsigned ch = 0; ch < 16; ++ch) {
+            if (!tracks[i].channel[ch].empty())
+                dens->lanes.push_back(fmidi_density_lane_t{(uint16_t)i, (uint8_t)ch});
+        }
+    }
+
+    size_t nlanes = dens->lanes.size();
+    size_t nlevels = dens->levels.size();
+    dens->cells.assign(nlanes * dens->lanesize, fmidi_density_cell_t{0, 0});
+
+    fmidi_parallel_for(nlanes, [&dens, &tracks, nbuckets, nlevels](unsigned lane) {
+        const fmidi_density_lane_t &ln = dens->lanes[lane];
+        std::vector<fmidi_density_cell_t> &src = tracks[ln.track].channel[ln.channel];
+        fmidi_density_cell_t *cells = &dens->cells[lane * dens->lanesize];
+        std::copy(src.begin(), src.end(), cells);
+        std::vector<fmidi_density_cell_t>().swap(src);
+
+        size_t n = nbuckets;
+        for (size_t level = 1; level < nlevels; ++level) {
+            const fmidi_density_cell_t *fine = &cells[dens->levels[level - 1]];
+            fmidi_density_cell_t *coarse = &cells[dens->levels[level]];
+            for (size_t i = 0; i < n; ++i) {
+                fmidi_density_cell_t &c = coarse[i / 2];
+                c.notes += fine[i].notes;
+                c.voices = std::max(c.voices, fine[i].voices);
+            }
+            n = (n + 1) / 2;
+        }
+    });
+
+    return dens.release();
+}
+
+fmidi_density_t *fmidi_density_new(const fmidi_smf_t *smf, uint32_t bucket)
+{
+    try {
+        return fmidi_density_create(smf, bucket);
+    }
+    catch (std::bad_alloc &) {
+        RET_FAIL(nullptr, fmidi_err_limit);
+    }
+}
+
+void fmidi_density_free(fmidi_density_t *dens)
+{
+    delete dens;
+}
+
+uint32_t fmidi_density_bucket(const fmidi_density_t *dens)
+{
+    return dens->bucket;
+}
+
+unsigned fmidi_density_lane_count(const fmidi_density_t *dens)
+{
+    return dens->lanes.size();
+}
+
+fmidi_density_lane_t fmidi_density_lane(const fmidi_density_t *dens, unsigned lane)
+{
+    return dens->lanes[lane];
+}
+
+void fmidi_density_query(
+    const fmidi_density_t *dens, unsigned lane, uint64_t tick0, uint64_t tick1,
+    fmidi_density_cell_t *cells, unsigned count)
+{
+    if (count == 0)
+        return;
+
+    double width = (tick1 > tick0) ? (double)(tick1 - tick0) / count : 0;
+    size_t nlevels = dens->levels.size();
+    size_t level = 0;
+    while (level + 1 < nlevels && ((uint64_t)dens->bucket << (level + 1)) <= width)
+        ++level;
+
+    const fmidi_density_cell_t *src =
+        &dens->cells[lane * dens->lanesize + dens->levels[level]];
+    size_t nsrc = ((level + 1 < nlevels) ? dens->levels[level + 1] : dens->lanesize) -
+        dens->levels[level];
+    double bwidth = (double)((uint64_t)dens->bucket << level);
+
+    // each cell takes the buckets which start within it, or otherwise the
+    // bucket which contains its start
+    for (unsigned i = 0; i < count; ++i) {
+        double start = (tick0 + i * width) / bwidth;
+        double end = (tick0 + (i + 1) * width) / bwidth;
+        size_t b0 = (size_t)ceil(start);
+        size_t b1 = (size_t)ceil(end);
+        if (b1 <= b0) {
+            b0 = (size_t)start;
+            b1 = b0 + 1;
+        }
+        fmidi_density_cell_t cell{0, 0};
+        for (size_t b = b0; b < b1 && b < nsrc; ++b) {
+            cell.notes += src[b].notes;
+            cell.voices = std::max(cell.voices, src[b].voices);
+        }
+        cells[i] = cell;
+    }
+}
+
+//------------------------------------------------------------------------------
+struct fmidi_density_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t bucket;
+    uint32_t lane_count;
+    uint32_t level_count;
+    uint64_t lane_size;
+};
+
+static const char fmidi_density_magic[8] = {'F', 'M', 'I', 'D', 'I', 'L', 'O', 'D'};
+enum { fmidi_density_version = 1 };
+
+size_t fmidi_density_image_size(const fmidi_density_t *dens)
+{
+    return sizeof(fmidi_density_header) +
+        dens->lanes.size() * sizeof(uint32_t) +
+        dens->levels.size() * sizeof(uint64_t) +
+        dens->cells.size() * sizeof(fmidi_density_cell_t);
+}
+
+bool fmidi_density_image_write(
+    const fmidi_density_t *dens, void *mem, size_t size)
+{
+    if (size < fmidi_density_image_size(dens))
+        RET_FAIL(false, fmidi_err_output);
+
+    uint8_t *p = (uint8_t *)mem;
+    fmidi_density_header hdr;
+    memcpy(hdr.magic, fmidi_density_magic, 8);
+    hdr.version = fmidi_density_version;
+    hdr.bucket = dens->bucket;
+    hdr.lane_count = dens->lanes.size();
+    hdr.level_count = dens->levels.size();
+    hdr.lane_size = dens->lanesize;
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+
+    for (const fmidi_density_lane_t &ln : dens->lanes) {
+        uint32_t value = ((uint32_t)ln.track << 8) | ln.channel;
+        memcpy(p, &value, sizeof(value));
+        p += sizeof(value);
+    }
+    for (size_t offset : dens->levels) {
+        uint64_t value = offset;
+        memcpy(p, &value, sizeof(value));
+        p += sizeof(value);
+    }
+    memcpy(p, dens->cells.data(), dens->cells.size() * sizeof(fmidi_density_cell_t));
+
+    return true;
+}
+
+fmidi_density_t *fmidi_density_image_read(const void *mem, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)mem;
+    const uint8_t *end = p + size;
+
+    fmidi_density_header hdr;
+    if (size < sizeof(hdr))
+        RET_FAIL(nullptr, fmidi_err_eof);
+    memcpy(&hdr, p, sizeof(hdr));
+    p += sizeof(hdr);
+    if (memcmp(hdr.magic, fmidi_density_magic, 8) ||
+        hdr.version != fmidi_density_version ||
+        hdr.bucket == 0 || hdr.level_count == 0)
+        RET_FAIL(nullptr, fmidi_err_format);
+
+    uint64_t ncells = (uint64_t)hdr.lane_count * hdr.lane_size;
+    if ((size_t)(end - p) / sizeof(uint32_t) < hdr.lane_count ||
+        (size_t)(end - p - hdr.lane_count * sizeof(uint32_t)) / sizeof(uint64_t) < hdr.level_count ||
+        (hdr.lane_size != 0 && ncells / hdr.lane_size != hdr.lane_count))
+        RET_FAIL(nullptr, fmidi_err_eof);
+
+    std::unique_ptr<fmidi_density_t> dens(new fmidi_density_t);
+    dens->bucket = hdr.bucket;
+    dens->lanesize = hdr.lane_size;
+
+    dens->lanes.resize(hdr.lane_count);
+    for (fmidi_density_lane_t &ln : dens->lanes) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        p += sizeof(value);
+        ln.track = value >> 8;
+        ln.channel = value & 15;
+    }
+
+    dens->levels.resize(hdr.level_count);
+    for (size_t i = 0; i < hdr.level_count; ++i) {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        p += sizeof(value);
+        if (value >= hdr.lane_size || (i == 0) != (value == 0) ||
+            (i > 0 && value <= dens->levels[i - 1]))
+            RET_FAIL(nullptr, fmidi_err_format);
+        dens->levels[i] = value;
+    }
+
+    if ((size_t)(end - p) / sizeof(fmidi_density_cell_t) < ncells)
+        RET_FAIL(nullptr, fmidi_err_eof);
+    dens->cells.resize(ncells);
+    memcpy(dens->cells.data(), p, ncells * sizeof(fmidi_density_cell_t));
+
+    return dens.release();
+}
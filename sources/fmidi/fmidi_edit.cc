@@ -0,0 +1,590 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
+#include "fmidi/fmidi_internal.h"
+#include "fmidi/fmidi_chase.h"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+static fmidi_event_t *fmidi_event_append(
+    std::vector<uint8_t> &evbuf, const fmidi_event_t *src, uint32_t delta)
+{
+    fmidi_event_t *evt = fmidi_event_alloc(evbuf, src->datalen);
+    memcpy(evt, src, fmidi_event_sizeof(src->datalen));
+    evt->delta = delta;
+    return evt;
+}
+
+// the largest delta of the file format, and the longest song which the
+// edits produce, so that the gaps split below take a bounded number of
+// events
+static const uint32_t fmidi_edit_delta_limit = 0x0fffffff;
+static const uint64_t fmidi_edit_tick_limit = (uint64_t)1 << 40;
+
+// append the event after a gap of any length, which is split by empty text
+// events where it is longer than a delta can be
+static fmidi_event_t *fmidi_event_append_after(
+    std::vector<uint8_t> &evbuf, const fmidi_event_t *src, uint64_t gap)
+{
+    if (gap > fmidi_edit_delta_limit) {
+        uint8_t padbuf[fmidi_event_sizeof(1)];
+        fmidi_event_t *pad = (fmidi_event_t *)padbuf;
+        pad->type = fmidi_event_meta;
+        pad->datalen = 1;
+        pad->data[0] = 0x01;
+        for (; gap > fmidi_edit_delta_limit; gap -= fmidi_edit_delta_limit)
+            fmidi_event_append(evbuf, pad, fmidi_edit_delta_limit);
+    }
+    return fmidi_event_append(evbuf, src, (uint32_t)gap);
+}
+
+bool fmidi_smf_set_track(
+    fmidi_smf_t *smf, uint16_t track, const fmidi_event_t *const *events, size_t count)
+{
+    if (track >= smf->info.track_count)
+        RET_FAIL(false, fmidi_err_input);
+
+    std::vector<uint8_t> evbuf;
+    for (size_t i = 0; i < count; ++i) {
+        const fmidi_event_t *src = events[i];
+        fmidi_event_t *evt = fmidi_event_alloc(evbuf, src->datalen);
+        memcpy(evt, src, fmidi_event_sizeof(src->datalen));
+    }
+
+    fmidi_raw_track &trk = smf->track[track];
+    fmidi_track_store(trk, evbuf);
+
+    // the original encoding is not valid anymore
+    trk.source.reset();
+    trk.sourcelength = 0;
+
+    smf->index.reset();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static bool fmidi_unit_valid(uint16_t unit)
+{
+    if (!(unit & (1 << 15)))
+        return unit != 0;
+    int fps = -(int8_t)(unit >> 8);
+    return (unit & 0xff) != 0 && (fps == 24 || fps == 25 || fps == 29 || fps == 30);
+}
+
+static uint64_t fmidi_round(double value, fmidi_rounding_t rounding)
+{
+    // tolerate the error of the time conversions
+    const double epsilon = 1e-6;
+    double result;
+    switch (rounding) {
+    default:
+    case fmidi_round_nearest: result = std::floor(value + 0.5); break;
+    case fmidi_round_down: result = std::floor(value + epsilon); break;
+    case fmidi_round_up: result = std::ceil(value - epsilon); break;
+    }
+    return (result > 0) ? (uint64_t)result : 0;
+}
+
+struct fmidi_rescaler {
+    uint16_t from = 0;
+    uint16_t to = 0;
+    fmidi_rounding_t rounding = fmidi_round_nearest;
+    std::vector<fmidi_tempo_change> frommap;  // in ticks of the old unit
+    std::vector<fmidi_tempo_change> tomap;  // in ticks of the new unit
+    uint64_t convert(uint64_t tick) const;
+};
+
+static void fmidi_rescaler_init(
+    fmidi_rescaler &rs, const fmidi_smf_t *smf, unsigned first, unsigned count)
+{
+    bool ppq = !(rs.from & (1 << 15)) && !(rs.to & (1 << 15));
+    if (ppq)
+        return;  // a plain ratio, the tempo changes follow the ticks
+
+    fmidi_tempo_map_build(smf, first, count, rs.frommap);
+
+    // tempo only applies to a unit in quarter notes. place the changes at
+    // the times they had before, with the times of the new positions as
+    // reference for the next, so that the rounding does not accumulate.
+    const std::vector<fmidi_tempo_change> &from = rs.frommap;
+    std::vector<fmidi_tempo_change> &to = rs.tomap;
+    to.resize(from.size());
+    to[0] = fmidi_tempo_change{0, 0, from[0].tempo};
+    for (size_t i = 1, n = from.size(); i < n; ++i) {
+        const fmidi_tempo_change &prev = to[i - 1];
+        double delta = fmidi_time_delta(from[i].time - prev.time, rs.to, prev.tempo);
+        uint64_t tick = prev.tick + fmidi_round(delta, rs.rounding);
+        double time = prev.time + fmidi_delta_time(tick - prev.tick, rs.to, prev.tempo);
+        to[i] = fmidi_tempo_change{tick, time, from[i].tempo};
+    }
+}
+
+uint64_t fmidi_rescaler::convert(uint64_t tick) const
+{
+    if (frommap.empty()) {
+        // exact in integers, by the quotient and the remainder
+        uint64_t q = tick / from, r = tick % from;
+        uint64_t n = r * to;
+        uint64_t p;
+        switch (rounding) {
+        default:
+        case fmidi_round_nearest: p = (2 * n + from) / (2 * from); break;
+        case fmidi_round_down: p = n / from; break;
+        case fmidi_round_up: p = (n + from - 1) / from; break;
+        }
+        return q * to + p;
+    }
+
+    const fmidi_tempo_change &fc = fmidi_tempo_at_tick(frommap, tick);
+    double time = fc.time + fmidi_delta_time(tick - fc.tick, from, fc.tempo);
+    const fmidi_tempo_change &tc = fmidi_tempo_at_time(tomap, time);
+    return tc.tick + fmidi_round(
+        fmidi_time_delta(time - tc.time, to, tc.tempo), rounding);
+}
+
+static uint64_t fmidi_track_length(const fmidi_raw_track &trk)
+{
+    const uint8_t *data = trk.data.get();
+    uint64_t tick = 0;
+    for (uint32_t offset = 0; offset < trk.length;) {
+        const fmidi_event_t *evt = (const fmidi_event_t *)&data[offset];
+        tick += evt->delta;
+        offset += fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
+    }
+    return tick;
+}
+
+// the deltas are converted in place, until one is too long, from which the
+// track is rebuilt with the gaps split
+static void fmidi_track_rescale(fmidi_raw_track &trk, const fmidi_rescaler &rs)
+{
+    if (!trk.exclusive)
+        fmidi_track_copy(trk, trk);
+
+    uint8_t *data = trk.data.get();
+    uint64_t tick = 0, newtick = 0;
+    std::vector<uint8_t> evbuf;
+    bool rebuild = false;
+    for (uint32_t offset = 0; offset < trk.length;) {
+        fmidi_event_t *evt = (fmidi_event_t *)&data[offset];
+        tick += evt->delta;
+        uint64_t next = rs.convert(tick);
+        uint64_t delta = next - newtick;
+        newtick = next;
+        fmidi_event_t *target = const_cast<fmidi_event_t *>(fmidi_track_resolve(trk, evt));
+        if (delta > fmidi_edit_delta_limit && !rebuild) {
+            rebuild = true;
+            for (uint32_t prev = 0; prev < offset;) {
+                const fmidi_event_t *done = (const fmidi_event_t *)&data[prev];
+                const fmidi_event_t *src = fmidi_track_resolve(trk, done);
+                fmidi_event_append(evbuf, src, src->delta);
+                prev += fmidi_event_pad(fmidi_event_sizeof(done->datalen));
+            }
+        }
+        if (rebuild)
+            fmidi_event_append_after(evbuf, target, delta);
+        else
+            evt->delta = target->delta = (uint32_t)delta;
+        offset += fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
+    }
+
+    if (rebuild)
+        fmidi_track_store(trk, evbuf);
+
+    trk.source.reset();
+    trk.sourcelength = 0;
+}
+
+bool fmidi_smf_rescale(fmidi_smf_t *smf, uint16_t unit, fmidi_rounding_t rounding)
+{
+    if (!fmidi_unit_valid(unit) || !fmidi_unit_valid(smf->info.delta_unit))
+        RET_FAIL(false, fmidi_err_input);
+
+    if (unit == smf->info.delta_unit)
+        return true;
+
+    unsigned ntracks = smf->info.track_count;
+    bool shared = smf->info.format != 2;
+
+    // format 2 tracks have tempo maps of their own
+    unsigned ngroups = shared ? 1 : ntracks;
+    std::vector<fmidi_rescaler> groups(ngroups);
+    for (unsigned g = 0; g < ngroups; ++g) {
+        fmidi_rescaler &rs = groups[g];
+        rs.from = smf->info.delta_unit;
+        rs.to = unit;
+        rs.rounding = rounding;
+        fmidi_rescaler_init(rs, smf, shared ? 0 : g, shared ? ntracks : 1);
+    }
+
+    // reject a result too long before any track is modified
+    for (unsigned i = 0; i < ntracks; ++i) {
+        const fmidi_rescaler &rs = groups[shared ? 0 : i];
+        if (rs.convert(fmidi_track_length(smf->track[i])) >= fmidi_edit_tick_limit)
+            RET_FAIL(false, fmidi_err_input);
+    }
+
+    fmidi_parallel_for(ntracks, [smf, &groups, shared](unsigned i) {
+        fmidi_track_rescale(smf->track[i], groups[shared ? 0 : i]);
+    });
+
+    smf->info.delta_unit = unit;
+    if (smf->index)
+        fmidi_smf_build_index(smf);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+struct fmidi_slice_prefix {
+    fmidi_chase_state target;
+    const fmidi_event_t *timesig = nullptr;
+    const fmidi_event_t *keysig = nullptr;
+};
+
+static uint64_t fmidi_slice_tick(
+    const std::vector<fmidi_tempo_change> &map, uint16_t unit, double time)
+{
+    const fmidi_tempo_change &tc = fmidi_tempo_at_time(map, time);
+    double tick = tc.tick + fmidi_time_delta(time - tc.time, unit, tc.tempo);
+    // positions past any track stand for the end
+    return (tick < 0x1p62) ? fmidi_round(tick, fmidi_round_up) : ((uint64_t)1 << 62);
+}
+
+// chase the events of the tracks which precede the stop positions, merged
+// in the order of the sequencer
+static void fmidi_slice_chase(
+    fmidi_slice_prefix &pre, const fmidi_smf_t *smf, unsigned first,
+    unsigned count, const fmidi_track_iter_t *stop)
+{
+    struct cursor {
+        fmidi_track_iter_t it;
+        const fmidi_event_t *evt;
+        uint64_t tick;
+    };
+
+    std::vector<cursor> cur(count);
+    auto advance = [smf, stop](cursor &c, unsigned i) {
+        c.evt = (c.it.index < stop[i].index) ? fmidi_smf_track_next(smf, &c.it) : nullptr;
+        if (c.evt)
+            c.tick += c.evt->delta;
+    };
+    for (unsigned i = 0; i < count; ++i) {
+        fmidi_smf_track_begin(&cur[i].it, first + i);
+        cur[i].tick = 0;
+        advance(cur[i], i);
+    }
+
+    fmidi_chase_reset(pre.target);
+    for (;;) {
+        unsigned next = count;
+        for (unsigned i = 0; i < count; ++i) {
+            if (cur[i].evt && (next == count || cur[i].tick < cur[next].tick))
+                next = i;
+        }
+        if (next == count)
+            break;
+
+        const fmidi_event_t *evt = cur[next].evt;
+        fmidi_chase_update(pre.target, *evt);
+        if (evt->type == fmidi_event_meta && evt->datalen >= 1) {
+            if (evt->data[0] == 0x58)  // time signature
+                pre.timesig = evt;
+            else if (evt->data[0] == 0x59)  // key signature
+                pre.keysig = evt;
+        }
+        advance(cur[next], next);
+    }
+}
+
+// events which bring a receiver from reset to the state before the slice
+static void fmidi_slice_emit(std::vector<uint8_t> &evbuf, const fmidi_slice_prefix &pre)
+{
+    fmidi_chase_state sink;
+    fmidi_chase_reset(sink);
+    fmidi_chase_emit(sink, pre.target, [](const fmidi_event_t *evt, void *data) {
+        fmidi_event_append(*(std::vector<uint8_t> *)data, evt, 0);
+    }, &evbuf);
+    if (pre.timesig)
+        fmidi_event_append(evbuf, pre.timesig, 0);
+    if (pre.keysig)
+        fmidi_event_append(evbuf, pre.keysig, 0);
+}
+
+// copy the events of the track from the seek position to the end of the
+// window, and end the notes which are still sounding there
+static void fmidi_slice_copy(
+    std::vector<uint8_t> &evbuf, const fmidi_smf_t *smf, fmidi_track_iter_t it,
+    uint64_t tick, uint64_t tick0, uint64_t tick1)
+{
+    bool notes[16][128] = {};
+    uint64_t last = tick0;
+    bool first = true;
+    bool cut = false;
+
+    for (const fmidi_event_t *src; (src = fmidi_smf_track_next(smf, &it));) {
+        if (!first)
+            tick += src->delta;
+        first = false;
+        if (tick >= tick1) {
+            cut = true;
+            break;
+        }
+
+        bool eot = src->type == fmidi_event_meta &&
+            src->datalen >= 1 && src->data[0] == 0x2f;
+        if (eot) {
+            last = tick;
+            break;
+        }
+
+        fmidi_event_append(evbuf, src, (uint32_t)(tick - last));
+        last = tick;
+
+        if (src->type == fmidi_event_message && src->datalen == 3) {
+            unsigned status = src->data[0];
+            if ((status >> 4) == 0b1000 || (status >> 4) == 0b1001)
+                notes[status & 15][src->data[1] & 127] =
+                    (status >> 4) == 0b1001 && (src->data[2] & 127);
+        }
+    }
+
+    uint64_t end = cut ? tick1 : last;
+
+    uint8_t evtbuf[fmidi_event_sizeof(3)];
+    fmidi_event_t *off = (fmidi_event_t *)evtbuf;
+    off->type = fmidi_event_message;
+    off->datalen = 3;
+    for (unsigned c = 0; c < 16 && cut; ++c) {
+        for (unsigned k = 0; k < 128; ++k) {
+            if (!notes[c][k])
+                continue;
+            off->data[0] = (0b1000 << 4) | c;
+            off->data[1] = k;
+            off->data[2] = 0;
+            fmidi_event_append(evbuf, off, (uint32_t)(end - last));
+            last = end;
+        }
+    }
+
+    off->type = fmidi_event_meta;
+    off->datalen = 1;
+    off->data[0] = 0x2f;
+    fmidi_event_append(evbuf, off, (uint32_t)(end - last));
+}
+
+fmidi_smf_t *fmidi_smf_slice(const fmidi_smf_t *smf, double t0, double t1)
+{
+    if (!(t0 >= 0) || !(t1 >= t0))
+        RET_FAIL(nullptr, fmidi_err_input);
+
+    unsigned ntracks = smf->info.track_count;
+    uint16_t unit = smf->info.delta_unit;
+    bool shared = smf->info.format != 2;
+
+    fmidi_smf_u result(new fmidi_smf_t);
+    result->info = smf->info;
+    result->track.reset(new fmidi_raw_track[ntracks]);
+
+    std::vector<uint8_t> evbuf;
+    std::vector<fmidi_tempo_change> map;
+    std::unique_ptr<fmidi_track_iter_t[]> seek(new fmidi_track_iter_t[ntracks]);
+    std::unique_ptr<uint64_t[]> seektick(new uint64_t[ntracks]);
+
+    // format 2 tracks have tempo maps of their own, and states as well
+    unsigned ngroups = shared ? 1 : ntracks;
+    for (unsigned g = 0; g < ngroups; ++g) {
+        unsigned first = shared ? 0 : g;
+        unsigned count = shared ? ntracks : 1;
+
+        fmidi_tempo_map_build(smf, first, count, map);
+        uint64_t tick0 = fmidi_slice_tick(map, unit, t0);
+        uint64_t tick1 = fmidi_slice_tick(map, unit, t1);
+
+        for (unsigned i = first; i < first + count; ++i)
+            seektick[i] = fmidi_track_seek_tick(smf, &seek[i], i, tick0);
+
+        fmidi_slice_prefix pre;
+        fmidi_slice_chase(pre, smf, first, count, &seek[first]);
+
+        for (unsigned i = first; i < first + count; ++i) {
+            evbuf.clear();
+            // the state goes at the start of the first track
+            if (i == first)
+                fmidi_slice_emit(evbuf, pre);
+            fmidi_slice_copy(evbuf, smf, seek[i], seektick[i], tick0, tick1);
+            fmidi_track_store(result->track[i], evbuf);
+        }
+    }
+
+    return result.release();
+}
+
+//------------------------------------------------------------------------------
+static uint16_t fmidi_concat_unit(const fmidi_smf_t *const *smfs, size_t count)
+{
+    uint16_t first = smfs[0]->info.delta_unit;
+    uint32_t lcm = 1, max = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t unit = smfs[i]->info.delta_unit;
+        if (unit & (1 << 15))
+            return first;  // with frames, keep the time of the first song
+        uint32_t a = lcm, b = unit;
+        while (b) {
+            uint32_t r = a % b;
+            a = b;
+            b = r;
+        }
+        lcm = (lcm < (1 << 15)) ? lcm / a * unit : lcm;
+        max = std::max(max, unit);
+    }
+    // ticks of every song fall on ticks of the common unit, if it fits
+    return (lcm < (1 << 15)) ? lcm : max;
+}
+
+fmidi_smf_t *fmidi_smf_concat(
+    const fmidi_smf_t *const *smfs, size_t count, const double *gaps,
+    fmidi_concat_policy_t policy)
+{
+    if (count == 0)
+        RET_FAIL(nullptr, fmidi_err_input);
+
+    unsigned ntracks = 0;
+    size_t total = 0;
+    for (size_t s = 0; s < count; ++s) {
+        const fmidi_smf_t *smf = smfs[s];
+        // songs of independent tracks do not have an end to append after
+        if (smf->info.format == 2 || !fmidi_unit_valid(smf->info.delta_unit))
+            RET_FAIL(nullptr, fmidi_err_input);
+        if (gaps && s + 1 < count && !(gaps[s] >= 0))
+            RET_FAIL(nullptr, fmidi_err_input);
+        ntracks = std::max<unsigned>(ntracks, smf->info.track_count);
+        for (unsigned i = 0; i < smf->info.track_count; ++i)
+            total += smf->track[i].length;
+    }
+
+    uint16_t unit = fmidi_concat_unit(smfs, count);
+
+    // every track is written once, in a buffer sized for the whole
+    std::vector<std::vector<uint8_t>> out(ntracks);
+    for (std::vector<uint8_t> &evbuf : out)
+        evbuf.reserve(total / ntracks + 64);
+    std::vector<uint64_t> last(ntracks, 0);  // time of the last event written
+
+    uint8_t evtbuf[fmidi_event_sizeof(4)];
+    fmidi_event_t *meta = (fmidi_event_t *)evtbuf;
+
+    uint64_t offset = 0;  // start of the current song
+    uint32_t tempo = 500000;  // in effect at the end of the previous song
+
+    for (size_t s = 0; s < count; ++s) {
+        const fmidi_smf_t *smf = smfs[s];
+        unsigned songtracks = smf->info.track_count;
+
+        if (s > 0) {
+            const fmidi_smf_t *prev = smfs[s - 1];
+
+            // return the channels to the state after reset, at the end
+            if (policy == fmidi_concat_reset) {
+                unsigned prevtracks = prev->info.track_count;
+                std::unique_ptr<fmidi_track_iter_t[]> stop(new fmidi_track_iter_t[prevtracks]);
+                for (unsigned i = 0; i < prevtracks; ++i) {
+                    fmidi_smf_track_begin(&stop[i], i);
+                    stop[i].index = prev->track[i].length;
+                }
+                fmidi_slice_prefix pre;
+                fmidi_slice_chase(pre, prev, 0, prevtracks, stop.get());
+                fmidi_chase_state target;
+                fmidi_chase_reset(target);
+                std::vector<uint8_t> reset;
+                fmidi_chase_emit(pre.target, target, [](const fmidi_event_t *evt, void *data) {
+                    fmidi_event_append(*(std::vector<uint8_t> *)data, evt, 0);
+                }, &reset);
+                for (size_t pos = 0; pos < reset.size();) {
+                    const fmidi_event_t *evt = (const fmidi_event_t *)&reset[pos];
+                    fmidi_event_append_after(out[0], evt, offset - last[0]);
+                    last[0] = offset;
+                    pos += fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
+                }
+                tempo = target.tempo;
+            }
+
+            if (gaps) {
+                double gap = fmidi_time_delta(gaps[s - 1], unit, tempo);
+                if (!(gap < fmidi_edit_tick_limit - offset))
+                    RET_FAIL(nullptr, fmidi_err_input);
+                offset += fmidi_round(gap, fmidi_round_nearest);
+            }
+
+            // the song starts at the default tempo, unless it sets its own
+            if (tempo != 500000) {
+                meta->type = fmidi_event_meta;
+                meta->datalen = 4;
+                meta->data[0] = 0x51;
+                meta->data[1] = 500000 >> 16;
+                meta->data[2] = (500000 >> 8) & 0xff;
+                meta->data[3] = 500000 & 0xff;
+                fmidi_event_append_after(out[0], meta, offset - last[0]);
+                last[0] = offset;
+                tempo = 500000;
+            }
+        }
+
+        fmidi_rescaler rs;
+        rs.from = smf->info.delta_unit;
+        rs.to = unit;
+        if (rs.from != rs.to)
+            fmidi_rescaler_init(rs, smf, 0, songtracks);
+
+        uint64_t end = offset;
+        uint64_t tempotick = 0;
+
+        for (unsigned i = 0; i < songtracks; ++i) {
+            std::vector<uint8_t> &evbuf = out[i];
+            fmidi_track_iter_t it;
+            fmidi_smf_track_begin(&it, i);
+            uint64_t tick = 0;
+            for (const fmidi_event_t *src; (src = fmidi_smf_track_next(smf, &it));) {
+                tick += src->delta;
+                uint64_t abstick = offset + ((rs.from != rs.to) ? rs.convert(tick) : tick);
+                if (abstick >= fmidi_edit_tick_limit)
+                    RET_FAIL(nullptr, fmidi_err_input);
+                end = std::max(end, abstick);
+                if (src->type == fmidi_event_meta && src->datalen >= 1) {
+                    if (src->data[0] == 0x2f)  // end of track, written once at the end
+                        continue;
+                    // at equal ticks, the change of the higher track applies last
+                    if (src->data[0] == 0x51 && src->datalen == 4 && abstick >= tempotick) {
+                        tempo = (src->data[1] << 16) | (src->data[2] << 8) | src->data[3];
+                        tempotick = abstick;
+                    }
+                }
+                fmidi_event_append_after(evbuf, src, abstick - last[i]);
+                last[i] = abstick;
+            }
+        }
+
+        offset = end;
+    }
+
+    fmidi_smf_u smf(new fmidi_smf_t);
+    smf->info.format = (ntracks > 1) ? 1 : 0;
+    smf->info.track_count = ntracks;
+    smf->info.delta_unit = unit;
+    smf->track.reset(new fmidi_raw_track[ntracks]);
+
+    meta->type = fmidi_event_meta;
+    meta->datalen = 1;
+    meta->data[0] = 0x2f;
+    for (unsigned i = 0; i < ntracks; ++i) {
+        fmidi_event_append_after(out[i], meta, offset - last[i]);
+        fmidi_track_store(smf->track[i], out[i]);
+        std::vector<uint8_t>().swap(out[i]);
+    }
+
+    return smf.release();
+}
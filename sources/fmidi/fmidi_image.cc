@@ -0,0 +1,728 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
+#include "fmidi/fmidi_internal.h"
+#include "fmidi/u_stdio.h"
+#include <unordered_map>
+#include <string>
+#include <atomic>
+#include <new>
+#include <string.h>
+#if !defined(_WIN32)
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+// The image is the position-independent representation of a song, which
+// other processes can use in place. Tracks are referred to by offset.
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2,
+              "image reference count requires lock-free atomics");
+static_assert(sizeof(fmidi_event_type_t) == 4,
+              "image events require 32-bit types");
+
+struct fmidi_image_header {
+    char magic[8];
+    uint32_t version;
+    std::atomic<uint32_t> refcount;  // views on the shared memory
+    uint64_t size;
+    uint16_t format;
+    uint16_t track_count;
+    uint16_t delta_unit;
+    uint16_t reserved;
+};
+
+struct fmidi_image_track {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t payloadlength;  // events stored apart, after the track
+};
+
+static const char fmidi_image_magic[8] = {'F', 'M', 'I', 'D', 'I', 'I', 'M', 'G'};
+enum { fmidi_image_version = 1 };
+
+static size_t fmidi_image_align(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+// contents of a track in the image, which has its own copy of the events
+// the track refers to in an interning pool
+struct fmidi_image_contents {
+    const uint8_t *data;
+    uint32_t length;
+    const uint8_t *payload;
+    uint32_t payloadlength;
+    std::vector<uint8_t> databuf;
+    std::vector<uint8_t> payloadbuf;
+};
+
+static void fmidi_image_prepare(const fmidi_raw_track &trk, fmidi_image_contents &ct)
+{
+    if (!trk.interned) {
+        ct.data = trk.data.get();
+        ct.length = trk.length;
+        ct.payload = trk.payload.get();
+        ct.payloadlength = trk.payloadlength;
+        return;
+    }
+
+    const uint8_t *data = trk.data.get();
+    for (uint32_t offset = 0; offset < trk.length;) {
+        const fmidi_event_t *evt = (const fmidi_event_t *)&data[offset];
+        size_t size = fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
+        if (evt->type == (fmidi_event_type_t)fmidi_event_outline ||
+            evt->type == (fmidi_event_type_t)fmidi_event_interned) {
+            const fmidi_event_t *target = fmidi_track_resolve(trk, evt);
+            uint32_t targetoffset = ct.payloadbuf.size();
+            const uint8_t *targetdata = (const uint8_t *)target;
+            ct.payloadbuf.insert(
+                ct.payloadbuf.end(), targetdata,
+                targetdata + fmidi_event_pad(fmidi_event_sizeof(target->datalen)));
+            fmidi_event_t *ref = fmidi_event_alloc(ct.databuf, 4);
+            ref->type = (fmidi_event_type_t)fmidi_event_outline;
+            ref->delta = evt->delta;
+            ref->datalen = 4;
+            memcpy(ref->data, &targetoffset, 4);
+        }
+        else
+            ct.databuf.insert(ct.databuf.end(), &data[offset], &data[offset] + size);
+        offset += size;
+    }
+
+    ct.data = ct.databuf.data();
+    ct.length = ct.databuf.size();
+    ct.payload = ct.payloadbuf.data();
+    ct.payloadlength = ct.payloadbuf.size();
+}
+
+size_t fmidi_smf_image_size(const fmidi_smf_t *smf)
+{
+    unsigned ntracks = smf->info.track_count;
+    size_t size = sizeof(fmidi_image_header) + ntracks * sizeof(fmidi_image_track);
+    for (unsigned i = 0; i < ntracks; ++i) {
+        fmidi_image_contents ct;
+        fmidi_image_prepare(smf->track[i], ct);
+        size = fmidi_image_align(size) + ct.length;
+        size = fmidi_image_align(size) + ct.payloadlength;
+    }
+    return fmidi_image_align(size);
+}
+
+bool fmidi_smf_image_write(const fmidi_smf_t *smf, void *mem, size_t size)
+{
+    size_t imagesize = fmidi_smf_image_size(smf);
+    if (size < imagesize)
+        RET_FAIL(false, fmidi_err_output);
+
+    uint8_t *base = (uint8_t *)mem;
+    unsigned ntracks = smf->info.track_count;
+
+    fmidi_image_header *hdr = new (base) fmidi_image_header;
+    memcpy(hdr->magic, fmidi_image_magic, 8);
+    hdr->version = fmidi_image_version;
+    hdr->refcount.store(0);
+    hdr->size = imagesize;
+    hdr->format = smf->info.format;
+    hdr->track_count = ntracks;
+    hdr->delta_unit = smf->info.delta_unit;
+    hdr->reserved = 0;
+
+    fmidi_image_track *table = (fmidi_image_track *)(hdr + 1);
+    size_t offset = sizeof(fmidi_image_header) + ntracks * sizeof(fmidi_image_track);
+    for (unsigned i = 0; i < ntracks; ++i) {
+        fmidi_image_contents ct;
+        fmidi_image_prepare(smf->track[i], ct);
+        offset = fmidi_image_align(offset);
+        table[i].offset = offset;
+        table[i].length = ct.length;
+        table[i].payloadlength = ct.payloadlength;
+        memcpy(base + offset, ct.data, ct.length);
+        offset += ct.length;
+        size_t nextoffset = fmidi_image_align(offset);
+        memset(base + offset, 0, nextoffset - offset);
+        offset = nextoffset;
+        memcpy(base + offset, ct.payload, ct.payloadlength);
+        offset += ct.payloadlength;
+    }
+    memset(base + offset, 0, imagesize - offset);
+
+    return true;
+}
+
+// the type as stored, which can be outside of the enumeration
+static uint32_t fmidi_image_event_type(const fmidi_event_t *evt)
+{
+    uint32_t type;
+    memcpy(&type, &evt->type, sizeof(type));
+    return type;
+}
+
+static bool fmidi_image_public_type(const fmidi_event_t *evt)
+{
+    switch (fmidi_image_event_type(evt)) {
+    case fmidi_event_meta:
+    case fmidi_event_message:
+    case fmidi_event_escape:
+    case fmidi_event_xmi_timbre:
+    case fmidi_event_xmi_branch_point:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// checks that every event of a track stays within its length, and that
+// outline events refer to whole events of the payload, before any reader
+// is allowed to follow the track. the image comes from outside the process,
+// so it must not have interned events, which hold addresses.
+static bool fmidi_image_check_track(
+    const uint8_t *data, uint32_t length, const uint8_t *payload, uint32_t payloadlength)
+{
+    const uint32_t headsize = offsetof(fmidi_event_t, data);
+    for (uint32_t offset = 0; offset < length;) {
+        if (length - offset < headsize)
+            return false;
+        const fmidi_event_t *evt = (const fmidi_event_t *)&data[offset];
+        uint64_t evsize = fmidi_event_pad((uint64_t)headsize + evt->datalen);
+        if (evsize > length - offset)
+            return false;
+        if (fmidi_image_event_type(evt) == fmidi_event_outline) {
+            uint32_t poff;
+            if (evt->datalen != 4)
+                return false;
+            memcpy(&poff, evt->data, 4);
+            if (poff % alignof(fmidi_event_t) != 0 ||
+                poff > payloadlength || payloadlength - poff < headsize)
+                return false;
+            const fmidi_event_t *target = (const fmidi_event_t *)&payload[poff];
+            if ((uint64_t)headsize + target->datalen > payloadlength - poff ||
+                !fmidi_image_public_type(target))
+                return false;
+        }
+        else if (!fmidi_image_public_type(evt))
+            return false;
+        offset += evsize;
+    }
+    return true;
+}
+
+static fmidi_smf_t *fmidi_image_load(
+    const uint8_t *base, size_t size, const std::shared_ptr<uint8_t> &owner)
+{
+    const fmidi_image_header *hdr = (const fmidi_image_header *)base;
+    if ((uintptr_t)base % alignof(fmidi_image_header) != 0 ||
+        size < sizeof(fmidi_image_header) ||
+        memcmp(hdr->magic, fmidi_image_magic, 8) ||
+        hdr->version != fmidi_image_version || hdr->size > size)
+        RET_FAIL(nullptr, fmidi_err_format);
+
+    unsigned ntracks = hdr->track_count;
+    size = hdr->size;
+    uint64_t tablesize = sizeof(fmidi_image_header) +
+        (uint64_t)ntracks * sizeof(fmidi_image_track);
+    if (tablesize > size)
+        RET_FAIL(nullptr, fmidi_err_format);
+
+    fmidi_smf_u smf(new fmidi_smf);
+    smf->info.format = hdr->format;
+    smf->info.track_count = ntracks;
+    smf->info.delta_unit = hdr->delta_unit;
+    smf->track.reset(new fmidi_raw_track[ntracks]);
+
+    const fmidi_image_track *table = (const fmidi_image_track *)(hdr + 1);
+    for (unsigned i = 0; i < ntracks; ++i) {
+        uint64_t offset = table[i].offset;
+        uint32_t length = table[i].length;
+        uint32_t payloadlength = table[i].payloadlength;
+        if (offset > size || size - offset < length ||
+            offset % alignof(fmidi_event_t) != 0)
+            RET_FAIL(nullptr, fmidi_err_format);
+        uint64_t payloadoffset = fmidi_image_align(offset + length);
+        if (payloadlength && (payloadoffset > size || size - payloadoffset < payloadlength))
+            RET_FAIL(nullptr, fmidi_err_format);
+        if (!fmidi_image_check_track(
+                base + offset, length, base + payloadoffset, payloadlength))
+            RET_FAIL(nullptr, fmidi_err_format);
+        fmidi_raw_track &trk = smf->track[i];
+        trk.data = std::shared_ptr<uint8_t>(owner, const_cast<uint8_t *>(base + offset));
+        trk.length = length;
+        if (payloadlength) {
+            trk.payload = std::shared_ptr<uint8_t>(
+                owner, const_cast<uint8_t *>(base + payloadoffset));
+            trk.payloadlength = payloadlength;
+        }
+    }
+
+    return smf.release();
+}
+
+fmidi_smf_t *fmidi_smf_image_view(const void *mem, size_t size)
+{
+    return fmidi_image_load((const uint8_t *)mem, size, nullptr);
+}
+
+//------------------------------------------------------------------------------
+#if !defined(_WIN32)
+struct fmidi_image_mapping {
+    ~fmidi_image_mapping();
+    std::string name;
+    uint8_t *data = nullptr;  // read-only
+    size_t size = 0;
+    fmidi_image_header *header = nullptr;  // read-write
+    bool acquired = false;
+};
+
+fmidi_image_mapping::~fmidi_image_mapping()
+{
+    if (acquired && header->refcount.fetch_sub(1) == 1)
+        shm_unlink(name.c_str());  // the last view is gone
+    if (header)
+        munmap(header, sizeof(fmidi_image_header));
+    if (data)
+        munmap(data, size);
+}
+
+static bool fmidi_image_acquire(fmidi_image_header *hdr)
+{
+    // increment, unless the image is already being released
+    uint32_t count = hdr->refcount.load();
+    do {
+        if (count == 0)
+            return false;
+    } while (!hdr->refcount.compare_exchange_weak(count, count + 1));
+    return true;
+}
+
+static fmidi_smf_t *fmidi_image_map(int fd, const char *name, bool acquire)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        RET_FAIL(nullptr, fmidi_err_input);
+
+    size_t size = st.st_size;
+    if (size < sizeof(fmidi_image_header))
+        RET_FAIL(nullptr, fmidi_err_format);
+
+    std::shared_ptr<fmidi_image_mapping> map(new fmidi_image_mapping);
+    map->name = name;
+
+    void *header = mmap(nullptr, sizeof(fmidi_image_header),
+                        PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+        RET_FAIL(nullptr, fmidi_err_input);
+    map->header = (fmidi_image_header *)header;
+
+    void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+        RET_FAIL(nullptr, fmidi_err_input);
+    map->data = (uint8_t *)data;
+    map->size = size;
+
+    if (memcmp(map->header->magic, fmidi_image_magic, 8))
+        RET_FAIL(nullptr, fmidi_err_format);
+
+    if (acquire) {
+        if (!fmidi_image_acquire(map->header))
+            RET_FAIL(nullptr, fmidi_err_input);
+    }
+    map->acquired = true;
+
+    std::shared_ptr<uint8_t> owner(map, map->data);
+    return fmidi_image_load(map->data, size, owner);
+}
+
+fmidi_smf_t *fmidi_smf_shm_publish(const fmidi_smf_t *smf, const char *name)
+{
+    size_t size = fmidi_smf_image_size(smf);
+
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+    if (fd == -1)
+        RET_FAIL(nullptr, fmidi_err_output);
+
+    void *mem = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        mem = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        close(fd);
+        shm_unlink(name);
+        RET_FAIL(nullptr, fmidi_err_output);
+    }
+
+    fmidi_smf_image_write(smf, mem, size);
+    // the reference of the publisher's own view
+    ((fmidi_image_header *)mem)->refcount.store(1);
+    munmap(mem, size);
+
+    fmidi_smf_t *view = fmidi_image_map(fd, name, false);
+    close(fd);
+    if (!view)
+        shm_unlink(name);
+    return view;
+}
+
+fmidi_smf_t *fmidi_smf_shm_open(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+        RET_FAIL(nullptr, fmidi_err_input);
+
+    fmidi_smf_t *view = fmidi_image_map(fd, name, true);
+    close(fd);
+    return view;
+}
+#else
+fmidi_smf_t *fmidi_smf_shm_publish(const fmidi_smf_t *, const char *)
+{
+    RET_FAIL(nullptr, fmidi_err_output);
+}
+
+fmidi_smf_t *fmidi_smf_shm_open(const char *)
+{
+    RET_FAIL(nullptr, fmidi_err_input);
+}
+#endif
+
+//------------------------------------------------------------------------------
+// The pack is a sequence of songs referring to a table of distinct tracks,
+// which are found by a hash of their contents.
+
+struct fmidi_pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t song_count;
+    uint64_t size;
+    uint32_t track_count;  // distinct tracks
+    uint32_t ref_count;  // tracks of all the songs
+};
+
+struct fmidi_pack_track {
+    uint64_t offset;
+    uint64_t hash;
+    uint32_t length;
+    uint32_t payloadlength;
+};
+
+struct fmidi_pack_entry {
+    uint16_t format;
+    uint16_t track_count;
+    uint16_t delta_unit;
+    uint16_t reserved;
+    uint32_t first_ref;
+    uint32_t reserved2;
+};
+
+static const char fmidi_pack_magic[8] = {'F', 'M', 'I', 'D', 'I', 'P', 'A', 'K'};
+enum { fmidi_pack_version = 1 };
+
+struct fmidi_pack {
+    std::shared_ptr<uint8_t> owner;
+    const fmidi_pack_header *header = nullptr;
+    const fmidi_pack_track *tracks = nullptr;
+    const fmidi_pack_entry *songs = nullptr;
+    const uint32_t *refs = nullptr;
+};
+
+struct fmidi_pack_layout {
+    std::vector<fmidi_image_contents> tracks;
+    std::vector<uint64_t> hashes;
+    std::vector<uint32_t> refs;
+    size_t size = 0;
+};
+
+static uint64_t fmidi_pack_hash(const fmidi_image_contents &ct)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325u;
+    for (uint32_t i = 0; i < ct.length; ++i)
+        hash = (hash ^ ct.data[i]) * 0x100000001b3u;
+    for (uint32_t i = 0; i < ct.payloadlength; ++i)
+        hash = (hash ^ ct.payload[i]) * 0x100000001b3u;
+    return hash;
+}
+
+static bool fmidi_pack_same(const fmidi_image_contents &a, const fmidi_image_contents &b)
+{
+    return a.length == b.length && a.payloadlength == b.payloadlength &&
+        !memcmp(a.data, b.data, a.length) &&
+        !memcmp(a.payload, b.payload, a.payloadlength);
+}
+
+static void fmidi_pack_arrange(
+    const fmidi_smf_t *const *songs, size_t count, fmidi_pack_layout &lay)
+{
+    size_t nrefs = 0;
+    for (size_t i = 0; i < count; ++i)
+        nrefs += songs[i]->info.track_count;
+    lay.tracks.reserve(nrefs);
+    lay.refs.reserve(nrefs);
+
+    std::unordered_multimap<uint64_t, uint32_t> distinct;
+    for (size_t i = 0; i < count; ++i) {
+        const fmidi_smf_t *smf = songs[i];
+        for (unsigned t = 0, n = smf->info.track_count; t < n; ++t) {
+            fmidi_image_contents ct;
+            fmidi_image_prepare(smf->track[t], ct);
+            uint64_t hash = fmidi_pack_hash(ct);
+            uint32_t id = (uint32_t)-1;
+            auto range = distinct.equal_range(hash);
+            for (auto it = range.first; it != range.second && id == (uint32_t)-1; ++it) {
+                if (fmidi_pack_same(lay.tracks[it->second], ct))
+                    id = it->second;
+            }
+            if (id == (uint32_t)-1) {
+                id = lay.tracks.size();
+                lay.tracks.push_back(std::move(ct));
+                lay.hashes.push_back(hash);
+                distinct.emplace(hash, id);
+            }
+            lay.refs.push_back(id);
+        }
+    }
+
+    size_t size = sizeof(fmidi_pack_header) +
+        lay.tracks.size() * sizeof(fmidi_pack_track) +
+        count * sizeof(fmidi_pack_entry) + nrefs * sizeof(uint32_t);
+    for (const fmidi_image_contents &ct : lay.tracks) {
+        size = fmidi_image_align(size) + ct.length;
+        size = fmidi_image_align(size) + ct.payloadlength;
+    }
+    lay.size = fmidi_image_align(size);
+}
+
+static void fmidi_pack_store(
+    const fmidi_smf_t *const *songs, size_t count,
+    const fmidi_pack_layout &lay, uint8_t *base)
+{
+    uint32_t ntracks = lay.tracks.size();
+    uint32_t nrefs = lay.refs.size();
+
+    fmidi_pack_header *hdr = (fmidi_pack_header *)base;
+    memcpy(hdr->magic, fmidi_pack_magic, 8);
+    hdr->version = fmidi_pack_version;
+    hdr->song_count = count;
+    hdr->size = lay.size;
+    hdr->track_count = ntracks;
+    hdr->ref_count = nrefs;
+
+    fmidi_pack_track *tracks = (fmidi_pack_track *)(hdr + 1);
+    fmidi_pack_entry *songtable = (fmidi_pack_entry *)(tracks + ntracks);
+    uint32_t *refs = (uint32_t *)(songtable + count);
+
+    for (size_t i = 0, first = 0; i < count; ++i) {
+        const fmidi_smf_info_t &info = songs[i]->info;
+        fmidi_pack_entry &song = songtable[i];
+        song.format = info.format;
+        song.track_count = info.track_count;
+        song.delta_unit = info.delta_unit;
+        song.reserved = 0;
+        song.first_ref = first;
+        song.reserved2 = 0;
+        first += info.track_count;
+    }
+    memcpy(refs, lay.refs.data(), nrefs * sizeof(uint32_t));
+
+    size_t offset = (uint8_t *)(refs + nrefs) - base;
+    for (uint32_t i = 0; i < ntracks; ++i) {
+        const fmidi_image_contents &ct = lay.tracks[i];
+        size_t nextoffset = fmidi_image_align(offset);
+        memset(base + offset, 0, nextoffset - offset);
+        offset = nextoffset;
+        tracks[i].offset = offset;
+        tracks[i].hash = lay.hashes[i];
+        tracks[i].length = ct.length;
+        tracks[i].payloadlength = ct.payloadlength;
+        memcpy(base + offset, ct.data, ct.length);
+        offset += ct.length;
+        nextoffset = fmidi_image_align(offset);
+        memset(base + offset, 0, nextoffset - offset);
+        offset = nextoffset;
+        memcpy(base + offset, ct.payload, ct.payloadlength);
+        offset += ct.payloadlength;
+    }
+    memset(base + offset, 0, lay.size - offset);
+}
+
+size_t fmidi_pack_size(const fmidi_smf_t *const *songs, size_t count)
+{
+    fmidi_pack_layout lay;
+    fmidi_pack_arrange(songs, count, lay);
+    return lay.size;
+}
+
+bool fmidi_pack_write(
+    const fmidi_smf_t *const *songs, size_t count, void *mem, size_t size)
+{
+    fmidi_pack_layout lay;
+    fmidi_pack_arrange(songs, count, lay);
+    if (size < lay.size)
+        RET_FAIL(false, fmidi_err_output);
+    fmidi_pack_store(songs, count, lay, (uint8_t *)mem);
+    return true;
+}
+
+bool fmidi_pack_file_write(
+    const fmidi_smf_t *const *songs, size_t count, const char *filename)
+{
+    fmidi_pack_layout lay;
+    fmidi_pack_arrange(songs, count, lay);
+    std::unique_ptr<uint8_t[]> mem(new uint8_t[lay.size]);
+    fmidi_pack_store(songs, count, lay, mem.get());
+
+    unique_FILE fh(fmidi_fopen(filename, "wb"));
+    if (!fh)
+        RET_FAIL(false, fmidi_err_output);
+    if (fwrite(mem.get(), lay.size, 1, fh.get()) != 1 || fflush(fh.get()) != 0)
+        RET_FAIL(false, fmidi_err_output);
+    return true;
+}
+
+static fmidi_pack_t *fmidi_pack_load(
+    const uint8_t *base, size_t size, const std::shared_ptr<uint8_t> &owner)
+{
+    const fmidi_pack_header *hdr = (const fmidi_pack_header *)base;
+    if ((uintptr_t)base % alignof(fmidi_pack_header) != 0 ||
+        size < sizeof(fmidi_pack_header) ||
+        memcmp(hdr->magic, fmidi_pack_magic, 8) ||
+        hdr->version != fmidi_pack_version || hdr->size > size)
+        RET_FAIL(nullptr, fmidi_err_format);
+    size = hdr->size;
+
+    uint64_t tablesize = sizeof(fmidi_pack_header) +
+        (uint64_t)hdr->track_count * sizeof(fmidi_pack_track) +
+        (uint64_t)hdr->song_count * sizeof(fmidi_pack_entry) +
+        (uint64_t)hdr->ref_count * sizeof(uint32_t);
+    if (tablesize > size)
+        RET_FAIL(nullptr, fmidi_err_format);
+
+    std::unique_ptr<fmidi_pack_t> pack(new fmidi_pack_t);
+    pack->owner = owner;
+    pack->header = hdr;
+    pack->tracks = (const fmidi_pack_track *)(hdr + 1);
+    pack->songs = (const fmidi_pack_entry *)(pack->tracks + hdr->track_count);
+    pack->refs = (const uint32_t *)(pack->songs + hdr->song_count);
+
+    for (uint32_t i = 0; i < hdr->track_count; ++i) {
+        const fmidi_pack_track &trk = pack->tracks[i];
+        uint64_t payloadoffset = fmidi_image_align(trk.offset + trk.length);
+        if (trk.offset > size || size - trk.offset < trk.length ||
+            trk.offset % alignof(fmidi_event_t) != 0 ||
+            payloadoffset > size || size - payloadoffset < trk.payloadlength)
+            RET_FAIL(nullptr, fmidi_err_format);
+        if (!fmidi_image_check_track(
+                base + trk.offset, trk.length, base + payloadoffset, trk.payloadlength))
+            RET_FAIL(nullptr, fmidi_err_format);
+    }
+    for (uint32_t i = 0; i < hdr->song_count; ++i) {
+        const fmidi_pack_entry &song = pack->songs[i];
+        if (song.first_ref > hdr->ref_count ||
+            hdr->ref_count - song.first_ref < song.track_count)
+            RET_FAIL(nullptr, fmidi_err_format);
+    }
+    for (uint32_t i = 0; i < hdr->ref_count; ++i) {
+        if (pack->refs[i] >= hdr->track_count)
+            RET_FAIL(nullptr, fmidi_err_format);
+    }
+
+    return pack.release();
+}
+
+fmidi_pack_t *fmidi_pack_view(const void *mem, size_t size)
+{
+    return fmidi_pack_load((const uint8_t *)mem, size, nullptr);
+}
+
+void fmidi_pack_free(fmidi_pack_t *pack)
+{
+    delete pack;
+}
+
+size_t fmidi_pack_song_count(const fmidi_pack_t *pack)
+{
+    return pack->header->song_count;
+}
+
+fmidi_smf_t *fmidi_pack_song(const fmidi_pack_t *pack, size_t index)
+{
+    if (index >= pack->header->song_count)
+        RET_FAIL(nullptr, fmidi_err_input);
+
+    const fmidi_pack_entry &song = pack->songs[index];
+    const uint8_t *base = (const uint8_t *)pack->header;
+    unsigned ntracks = song.track_count;
+
+    fmidi_smf_u smf(new fmidi_smf);
+    smf->info.format = song.format;
+    smf->info.track_count = ntracks;
+    smf->info.delta_unit = song.delta_unit;
+    smf->track.reset(new fmidi_raw_track[ntracks]);
+
+    for (unsigned i = 0; i < ntracks; ++i) {
+        const fmidi_pack_track &ptrk = pack->tracks[pack->refs[song.first_ref + i]];
+        fmidi_raw_track &trk = smf->track[i];
+        uint8_t *data = const_cast<uint8_t *>(base + ptrk.offset);
+        trk.data = std::shared_ptr<uint8_t>(pack->owner, data);
+        trk.length = ptrk.length;
+        if (ptrk.payloadlength) {
+            uint8_t *payload = const_cast<uint8_t *>(
+                base + fmidi_image_align(ptrk.offset + ptrk.length));
+            trk.payload = std::shared_ptr<uint8_t>(pack->owner, payload);
+            trk.payloadlength = ptrk.payloadlength;
+        }
+    }
+
+    return smf.release();
+}
+
+#if !defined(_WIN32)
+struct fmidi_pack_mapping {
+    ~fmidi_pack_mapping() { if (data) munmap(data, size); }
+    uint8_t *data = nullptr;
+    size_t size = 0;
+};
+
+fmidi_pack_t *fmidi_pack_file_open(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        RET_FAIL(nullptr, fmidi_err_input);
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        RET_FAIL(nullptr, fmidi_err_input);
+
+    std::shared_ptr<fmidi_pack_mapping> map(new fmidi_pack_mapping);
+    map->data = (uint8_t *)data;
+    map->size = st.st_size;
+
+    std::shared_ptr<uint8_t> owner(map, map->data);
+    return fmidi_pack_load(map->data, map->size, owner);
+}
+#else
+fmidi_pack_t *fmidi_pack_file_open(const char *filename)
+{
+    unique_FILE fh(fmidi_fopen(filename, "rb"));
+    if (!fh || fseek(fh.get(), 0, SEEK_END) != 0)
+        RET_FAIL(nullptr, fmidi_err_input);
+    long size = ftell(fh.get());
+    if (size <= 0)
+        RET_FAIL(nullptr, fmidi_err_input);
+    rewind(fh.get());
+
+    std::shared_ptr<uint8_t> owner(
+        new uint8_t[size], std::default_delete<uint8_t[]>());
+    if (fread(owner.get(), size, 1, fh.get()) != 1)
+        RET_FAIL(nullptr, fmidi_err_input);
+    return fmidi_pack_load(owner.get(), size, owner);
+}
+#endif
@@ -0,0 +1,105 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
+#include <algorithm>
+
+void fmidi_track_index_build(
+    fmidi_track_index &idx, const fmidi_raw_track &trk)
+{
+    const uint8_t *data = trk.data.get();
+    uint32_t length = trk.length;
+    uint64_t tick = 0;
+
+    for (uint32_t offset = 0; offset < length;) {
+        const fmidi_event_t *evt = (const fmidi_event_t *)&data[offset];
+        tick += evt->delta;
+        idx.offset.push_back(offset);
+        idx.tick.push_back(tick);
+        offset += fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
+    }
+
+    idx.offset.shrink_to_fit();
+    idx.tick.shrink_to_fit();
+}
+
+void fmidi_smf_build_index(fmidi_smf_t *smf)
+{
+    unsigned ntracks = smf->info.track_count;
+    std::unique_ptr<fmidi_track_index[]> index(new fmidi_track_index[ntracks]);
+
+    // tracks are indexed independently
+    fmidi_parallel_for(ntracks, [smf, &index](unsigned i) {
+        fmidi_track_index_build(index[i], smf->track[i]);
+    });
+
+    smf->index = std::move(index);
+}
+
+const fmidi_event_t *fmidi_track_event_at(
+    const fmidi_smf_t *smf, uint16_t track, uint32_t number, uint64_t *tick)
+{
+    if (track >= smf->info.track_count)
+        return nullptr;
+
+    const uint8_t *data = smf->track[track].data.get();
+
+    if (smf->index) {
+        const fmidi_track_index &idx = smf->index[track];
+        if (number >= idx.offset.size())
+            return nullptr;
+        if (tick)
+            *tick = idx.tick[number];
+        const fmidi_event_t *evt = (const fmidi_event_t *)&data[idx.offset[number]];
+        return fmidi_track_resolve(smf->track[track], evt);
+    }
+
+    fmidi_track_iter_t it;
+    fmidi_smf_track_begin(&it, track);
+    const fmidi_event_t *evt;
+    uint64_t time = 0;
+    for (uint32_t i = 0; (evt = fmidi_smf_track_next(smf, &it)); ++i) {
+        time += evt->delta;
+        if (i == number) {
+            if (tick)
+                *tick = time;
+            return evt;
+        }
+    }
+    return nullptr;
+}
+
+uint64_t fmidi_track_seek_tick(
+    const fmidi_smf_t *smf, fmidi_track_iter_t *it, uint16_t track, uint64_t tick)
+{
+    fmidi_smf_track_begin(it, track);
+    if (track >= smf->info.track_count)
+        return 0;
+
+    const fmidi_raw_track &trk = smf->track[track];
+
+    if (smf->index) {
+        const fmidi_track_index &idx = smf->index[track];
+        size_t i = std::lower_bound(idx.tick.begin(), idx.tick.end(), tick) - idx.tick.begin();
+        if (i == idx.offset.size()) {
+            it->index = trk.length;
+            return idx.tick.empty() ? 0 : idx.tick.back();
+        }
+        it->index = idx.offset[i];
+        return idx.tick[i];
+    }
+
+    const uint8_t *data = trk.data.get();
+    uint64_t time = 0;
+    while (it->index < trk.length) {
+        const fmidi_event_t *evt = (const fmidi_event_t *)&data[it->index];
+        if (time + evt->delta >= tick)
+            return time + evt->delta;
+        time += evt->delta;
+        it->index += fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
+    }
+    return time;
+}
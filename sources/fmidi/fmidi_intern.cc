@@ -0,0 +1,86 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
+#include <unordered_map>
+#include <mutex>
+
+// The events are compared whole, with their delta, because the tracks refer
+// to the shared copy in place of the event.
+
+struct fmidi_intern_store {
+    std::mutex mutex;
+    std::unordered_multimap<uint64_t, const fmidi_event_t *> table;
+    std::vector<std::unique_ptr<uint8_t[]>> entries;
+    fmidi_intern_stats_t stats {};
+};
+
+struct fmidi_intern_pool {
+    std::shared_ptr<fmidi_intern_store> store;
+};
+
+static uint64_t fmidi_intern_hash(const uint8_t *data, size_t size)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325u;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ data[i]) * 0x100000001b3u;
+    return hash;
+}
+
+fmidi_intern_pool_t *fmidi_intern_pool_new()
+{
+    fmidi_intern_pool_t *pool = new fmidi_intern_pool_t;
+    pool->store = std::make_shared<fmidi_intern_store>();
+    return pool;
+}
+
+void fmidi_intern_pool_free(fmidi_intern_pool_t *pool)
+{
+    delete pool;
+}
+
+void fmidi_intern_pool_stats(
+    const fmidi_intern_pool_t *pool, fmidi_intern_stats_t *stats)
+{
+    fmidi_intern_store &store = *pool->store;
+    std::lock_guard<std::mutex> lock(store.mutex);
+    *stats = store.stats;
+}
+
+const fmidi_event_t *fmidi_intern_event(
+    fmidi_intern_pool_t *pool, const fmidi_event_t *evt, std::shared_ptr<const void> &owner)
+{
+    fmidi_intern_store &store = *pool->store;
+    owner = pool->store;
+
+    size_t size = fmidi_event_sizeof(evt->datalen);
+    uint64_t hash = fmidi_intern_hash((const uint8_t *)evt, size);
+
+    std::lock_guard<std::mutex> lock(store.mutex);
+    fmidi_intern_stats_t &stats = store.stats;
+    ++stats.lookups;
+
+    auto range = store.table.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        const fmidi_event_t *shared = it->second;
+        if (shared->datalen == evt->datalen && !memcmp(shared, evt, size)) {
+            ++stats.hits;
+            stats.saved_bytes += size;
+            return shared;
+        }
+    }
+
+    size_t padsize = fmidi_event_pad(size);
+    uint8_t *data = new uint8_t[padsize]();
+    store.entries.emplace_back(data);
+    memcpy(data, evt, size);
+    const fmidi_event_t *shared = (const fmidi_event_t *)data;
+    store.table.emplace(hash, shared);
+    ++stats.entries;
+    stats.stored_bytes += padsize;
+    return shared;
+}
@@ -6,6 +6,8 @@
 #include "fmidi/fmidi_internal.h"
 
 thread_local fmidi_error_info_t fmidi_last_error;
+thread_local fmidi_read_options_t fmidi_read_opts;
+thread_local fmidi_write_options_t fmidi_write_opts;
 
 fmidi_status_t fmidi_errno()
 {
@@ -26,10 +28,55 @@ const char *fmidi_strerror(fmidi_status_t status)
     case fmidi_err_input: return "input error";
     case fmidi_err_largefile: return "file too large";
     case fmidi_err_output: return "output error";
+    case fmidi_err_limit: return "limit exceeded";
     }
     return nullptr;
 }
 
+void fmidi_read_options_default(fmidi_read_options_t *opts)
+{
+    opts->flags = 0;
+    opts->event_limit = 0;
+    opts->sysex_limit = 0;
+    opts->track_limit = 0;
+    opts->filter = 0;
+    opts->filter_fn = nullptr;
+    opts->filter_data = nullptr;
+    opts->outline_limit = 0;
+    opts->intern_pool = nullptr;
+}
+
+const fmidi_read_options_t *fmidi_get_read_options()
+{
+    return &fmidi_read_opts;
+}
+
+void fmidi_set_read_options(const fmidi_read_options_t *opts)
+{
+    if (opts)
+        fmidi_read_opts = *opts;
+    else
+        fmidi_read_options_default(&fmidi_read_opts);
+}
+
+void fmidi_write_options_default(fmidi_write_options_t *opts)
+{
+    opts->flags = 0;
+}
+
+const fmidi_write_options_t *fmidi_get_write_options()
+{
+    return &fmidi_write_opts;
+}
+
+void fmidi_set_write_options(const fmidi_write_options_t *opts)
+{
+    if (opts)
+        fmidi_write_opts = *opts;
+    else
+        fmidi_write_options_default(&fmidi_write_opts);
+}
+
 //------------------------------------------------------------------------------
 void Memory_Writer::put(uint8_t byte)
 {
@@ -28,6 +28,8 @@ std::ostream &operator<<(std::ostream &out, const printfmt_bytes &b);
 
 //------------------------------------------------------------------------------
 extern thread_local fmidi_error_info_t fmidi_last_error;
+extern thread_local fmidi_read_options_t fmidi_read_opts;
+extern thread_local fmidi_write_options_t fmidi_write_opts;
 
 #if defined(FMIDI_DEBUG)
 # define RET_FAIL(x, e) do {                                      \
@@ -91,6 +93,14 @@ private:
     FILE *stream = nullptr;
 };
 
+//------------------------------------------------------------------------------
+class memstream;
+
+// decode the next SMF event in the buffer, or encode the events of a track
+fmidi_event_t *fmidi_smf_read_event(
+    memstream &mb, std::vector<uint8_t> &evbuf, uint8_t *runstatus);
+void fmidi_smf_write_track(const fmidi_smf_t *smf, unsigned track, Writer &writer);
+
 //------------------------------------------------------------------------------
 union Endian_check {
     uint32_t value;
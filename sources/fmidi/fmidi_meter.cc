@@ -0,0 +1,190 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
+#include "fmidi/fmidi_internal.h"
+#include <algorithm>
+#include <vector>
+
+struct fmidi_meter_change {
+    uint64_t tick;
+    uint32_t bar;  // the first bar of this meter
+    uint32_t beats;  // per bar
+    uint32_t beatlen;  // ticks per beat
+};
+
+struct fmidi_meter_map {
+    uint16_t unit;
+    std::vector<fmidi_meter_change> meter;
+    std::vector<fmidi_tempo_change> tempo;
+};
+
+fmidi_meter_map_t *fmidi_meter_map_new(const fmidi_smf_t *smf)
+{
+    uint16_t unit = smf->info.delta_unit;
+    if (unit & (1 << 15))
+        RET_FAIL(nullptr, fmidi_err_format);  // not metrical time
+
+    unsigned ntracks = smf->info.track_count;
+    if (smf->info.format == 2)
+        ntracks = std::min(ntracks, 1u);
+
+    std::unique_ptr<fmidi_meter_map_t> map(new fmidi_meter_map_t);
+    map->unit = unit;
+    fmidi_tempo_map_build(smf, 0, ntracks, map->tempo);
+
+    // time signatures, and at equal ticks the one of the higher track
+    struct signature { uint64_t tick; uint8_t num; uint8_t den; };
+    std::vector<signature> sigs;
+    for (unsigned i = 0; i < ntracks; ++i) {
+        const fmidi_event_t *evt;
+        fmidi_track_iter_t it;
+        fmidi_smf_track_begin(&it, i);
+        uint64_t tick = 0;
+        while ((evt = fmidi_smf_track_next(smf, &it))) {
+            tick += evt->delta;
+            if (evt->type == fmidi_event_meta &&
+                evt->data[0] == 0x58 && evt->datalen >= 3 && evt->data[1] > 0)
+                sigs.push_back(signature{tick, evt->data[1], evt->data[2]});
+        }
+    }
+    std::stable_sort(
+        sigs.begin(), sigs.end(),
+        [](const signature &a, const signature &b) { return a.tick < b.tick; });
+
+    // 4/4 until the first signature. a signature which falls in the middle
+    // of a bar cuts it short, and starts a new bar.
+    std::vector<fmidi_meter_change> &meter = map->meter;
+    meter.push_back(fmidi_meter_change{0, 0, 4, unit});
+    for (const signature &sig : sigs) {
+        fmidi_meter_change &prev = meter.back();
+        uint32_t beatlen = (sig.den < 32) ? ((4u * unit) >> sig.den) : 0;
+        fmidi_meter_change chg{sig.tick, 0, sig.num, std::max(beatlen, 1u)};
+        if (chg.tick == prev.tick) {
+            chg.bar = prev.bar;
+            prev = chg;
+        }
+        else {
+            uint64_t barlen = (uint64_t)prev.beats * prev.beatlen;
+            chg.bar = prev.bar + (chg.tick - prev.tick + barlen - 1) / barlen;
+            meter.push_back(chg);
+        }
+    }
+
+    return map.release();
+}
+
+void fmidi_meter_map_free(fmidi_meter_map_t *map)
+{
+    delete map;
+}
+
+// index of the last entry whose key is not after the value. the entry of
+// the previous search is tried first, and the one after it.
+template <class T, class Key>
+static size_t fmidi_meter_find(
+    const std::vector<T> &v, double value, size_t hint, Key key)
+{
+    size_t n = v.size();
+    for (size_t i = hint; i < n && i < hint + 2; ++i) {
+        if (key(v[i]) <= value && (i + 1 == n || value < key(v[i + 1])))
+            return i;
+    }
+    auto it = std::upper_bound(
+        v.begin() + 1, v.end(), value,
+        [&key](double value, const T &x) { return value < key(x); });
+    return it - v.begin() - 1;
+}
+
+static double fmidi_meter_time(
+    const fmidi_meter_map_t *map, double tick, size_t *hint)
+{
+    size_t i = *hint = fmidi_meter_find(
+        map->tempo, tick, *hint,
+        [](const fmidi_tempo_change &tc) -> double { return tc.tick; });
+    const fmidi_tempo_change &tc = map->tempo[i];
+    return tc.time + fmidi_delta_time(tick - tc.tick, map->unit, tc.tempo);
+}
+
+static double fmidi_meter_tick(
+    const fmidi_meter_map_t *map, double time, size_t *hint)
+{
+    size_t i = *hint = fmidi_meter_find(
+        map->tempo, time, *hint,
+        [](const fmidi_tempo_change &tc) -> double { return tc.time; });
+    const fmidi_tempo_change &tc = map->tempo[i];
+    return tc.tick + fmidi_time_delta(time - tc.time, map->unit, tc.tempo);
+}
+
+static fmidi_bbt_t fmidi_meter_bbt(
+    const fmidi_meter_map_t *map, uint64_t tick, size_t *hint)
+{
+    size_t i = *hint = fmidi_meter_find(
+        map->meter, tick, *hint,
+        [](const fmidi_meter_change &mc) -> double { return mc.tick; });
+    const fmidi_meter_change &mc = map->meter[i];
+    uint64_t barlen = (uint64_t)mc.beats * mc.beatlen;
+    uint64_t rel = tick - mc.tick;
+    fmidi_bbt_t bbt;
+    bbt.bar = mc.bar + rel / barlen;
+    rel %= barlen;
+    bbt.beat = rel / mc.beatlen;
+    bbt.tick = rel % mc.beatlen;
+    return bbt;
+}
+
+double fmidi_meter_tick_to_time(const fmidi_meter_map_t *map, double tick)
+{
+    size_t hint = 0;
+    return fmidi_meter_time(map, tick, &hint);
+}
+
+double fmidi_meter_time_to_tick(const fmidi_meter_map_t *map, double time)
+{
+    size_t hint = 0;
+    return fmidi_meter_tick(map, time, &hint);
+}
+
+fmidi_bbt_t fmidi_meter_tick_to_bbt(const fmidi_meter_map_t *map, uint64_t tick)
+{
+    size_t hint = 0;
+    return fmidi_meter_bbt(map, tick, &hint);
+}
+
+uint64_t fmidi_meter_bbt_to_tick(const fmidi_meter_map_t *map, fmidi_bbt_t bbt)
+{
+    const std::vector<fmidi_meter_change> &meter = map->meter;
+    auto it = std::upper_bound(
+        meter.begin() + 1, meter.end(), bbt.bar,
+        [](uint32_t bar, const fmidi_meter_change &mc) { return bar < mc.bar; });
+    const fmidi_meter_change &mc = *(it - 1);
+    return mc.tick + (uint64_t)(bbt.bar - mc.bar) * mc.beats * mc.beatlen +
+        (uint64_t)bbt.beat * mc.beatlen + bbt.tick;
+}
+
+void fmidi_meter_ticks_to_times(
+    const fmidi_meter_map_t *map, const uint64_t *ticks, double *times, size_t count)
+{
+    size_t hint = 0;
+    for (size_t i = 0; i < count; ++i)
+        times[i] = fmidi_meter_time(map, ticks[i], &hint);
+}
+
+void fmidi_meter_times_to_ticks(
+    const fmidi_meter_map_t *map, const double *times, double *ticks, size_t count)
+{
+    size_t hint = 0;
+    for (size_t i = 0; i < count; ++i)
+        ticks[i] = fmidi_meter_tick(map, times[i], &hint);
+}
+
+void fmidi_meter_ticks_to_bbt(
+    const fmidi_meter_map_t *map, const uint64_t *ticks, fmidi_bbt_t *bbt, size_t count)
+{
+    size_t hint = 0;
+    for (size_t i = 0; i < count; ++i)
+        bbt[i] = fmidi_meter_bbt(map, ticks[i], &hint);
+}
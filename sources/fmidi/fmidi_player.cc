@@ -4,8 +4,8 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include "fmidi/fmidi.h"
+#include "fmidi/fmidi_chase.h"
 #include <memory>
-#include <algorithm>
 #include <assert.h>
 
 struct fmidi_player_context {
@@ -19,6 +19,8 @@ struct fmidi_player_context {
     void *cbdata;
     void (*finifn)(void *);
     void *finidata;
+    fmidi_chase_state sink;
+    fmidi_chase_state target;
 };
 
 struct fmidi_player {
@@ -26,7 +28,7 @@ struct fmidi_player {
     fmidi_player_context ctx;
 };
 
-fmidi_player_t *fmidi_player_new(fmidi_smf_t *smf)
+fmidi_player_t *fmidi_player_new(const fmidi_smf_t *smf)
 {
     fmidi_player_u plr(new fmidi_player_t);
     plr->running = false;
@@ -41,6 +43,8 @@ fmidi_player_t *fmidi_player_new(fmidi_smf_t *smf)
     ctx.cbdata = nullptr;
     ctx.finifn = nullptr;
     ctx.finidata = nullptr;
+    // the output can be in any state, so the first seek sends all of it
+    fmidi_chase_forget(ctx.sink);
 
     return plr.release();
 }
@@ -63,8 +67,10 @@ void fmidi_player_tick(fmidi_player_t *plr, double delta)
         have_event = true;
         while (more && timepos > sqevt.time) {
             const fmidi_event_t &event = *sqevt.event;
-            if (cbfn)
+            if (cbfn) {
                 cbfn(&event, cbdata);
+                fmidi_chase_update(ctx.sink, event);
+            }
             have_event = more = fmidi_seq_next_event(&seq, &sqevt);
         }
     }
@@ -116,71 +122,22 @@ void fmidi_player_goto_time(fmidi_player_t *plr, double time)
 {
     fmidi_player_context &ctx = plr->ctx;
     fmidi_seq_t &seq = *ctx.seq;
+    fmidi_chase_state &target = ctx.target;
 
-    uint8_t programs[16];
-    uint8_t controls[16 * 128];
-    std::fill_n(programs, 16, 0);
-    std::fill_n(controls, 16 * 128, 255);
-
+    fmidi_chase_reset(target);
     fmidi_player_rewind(plr);
 
     for (fmidi_seq_event_t sqevt;
          fmidi_seq_peek_event(&seq, &sqevt) && sqevt.time < time;) {
-        const fmidi_event_t &evt = *sqevt.event;
-        if (evt.type == fmidi_event_message) {
-            uint8_t status = evt.data[0];
-            if (status >> 4 == 0b1100 && evt.datalen == 2) {  // program change
-                uint8_t channel = status & 0xf;
-                programs[channel] = evt.data[1] & 127;
-            }
-            else if (status >> 4 == 0b1011 && evt.datalen == 3) {  // control change
-                uint8_t channel = status & 0xf;
-                uint8_t id = evt.data[1] & 127;
-                controls[channel * 128 + id] = evt.data[2] & 127;
-            }
-        }
+        fmidi_chase_update(target, *sqevt.event);
         fmidi_seq_next_event(&seq, nullptr);
     }
 
     ctx.timepos = time;
 
-    if (ctx.cbfn) {
-        uint8_t evtbuf[fmidi_event_sizeof(3)];
-        fmidi_event_t *evt = (fmidi_event_t *)evtbuf;
-        evt->type = fmidi_event_message;
-        evt->delta = 0;
-
-        for (unsigned c = 0; c < 16; ++c) {
-            // all sound off
-            evt->datalen = 3;
-            evt->data[0] = (0b1011 << 4) | c;
-            evt->data[1] = 120;
-            evt->data[2] = 0;
-            ctx.cbfn(evt, ctx.cbdata);
-            // reset all controllers
-            evt->datalen = 3;
-            evt->data[0] = (0b1011 << 4) | c;
-            evt->data[1] = 121;
-            evt->data[2] = 0;
-            ctx.cbfn(evt, ctx.cbdata);
-            // program change
-            evt->datalen = 2;
-            evt->data[0] = (0b1100 << 4) | c;
-            evt->data[1] = programs[c];
-            ctx.cbfn(evt, ctx.cbdata);
-            // control change
-            for (unsigned id = 0; id < 128; ++id) {
-                uint8_t val = controls[c * 128 + id];
-                if (val < 128) {
-                    evt->datalen = 3;
-                    evt->data[0] = (0b1011 << 4) | c;
-                    evt->data[1] = id;
-                    evt->data[2] = val;
-                    ctx.cbfn(evt, ctx.cbdata);
-                }
-            }
-        }
-    }
+    // send only the state which differs from what the output holds
+    if (ctx.cbfn)
+        fmidi_chase_emit(ctx.sink, target, ctx.cbfn, ctx.cbdata);
 }
 
 double fmidi_player_current_speed(const fmidi_player_t *plr)
@@ -199,6 +156,7 @@ void fmidi_player_event_callback(
     fmidi_player_context &ctx = plr->ctx;
     ctx.cbfn = cbfn;
     ctx.cbdata = cbdata;
+    fmidi_chase_forget(ctx.sink);
 }
 
 void fmidi_player_finish_callback(
@@ -208,3 +166,18 @@ void fmidi_player_finish_callback(
     ctx.finifn = cbfn;
     ctx.finidata = cbdata;
 }
+
+void fmidi_player_mute_track(fmidi_player_t *plr, uint16_t track, bool mute)
+{
+    fmidi_seq_mute_track(plr->ctx.seq.get(), track, mute);
+}
+
+void fmidi_player_solo_track(fmidi_player_t *plr, uint16_t track, bool solo)
+{
+    fmidi_seq_solo_track(plr->ctx.seq.get(), track, solo);
+}
+
+void fmidi_player_set_channel_mask(fmidi_player_t *plr, uint16_t channels)
+{
+    fmidi_seq_set_channel_mask(plr->ctx.seq.get(), channels);
+}
@@ -0,0 +1,481 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
+#include <algorithm>
+#include <vector>
+#include <math.h>
+
+// the events are also listed by category and by channel, the last channel
+// being for the events which have none. a filter merges the lists which it
+// selects, or scans the range when most of its events pass.
+enum { fmidi_timeline_categories = 9, fmidi_timeline_channels = 17 };
+
+struct fmidi_timeline {
+    std::vector<fmidi_seq_event_t> events;
+    // for each event, its channel bit in the low half and its category in
+    // the high half, so that filters are tested by masking
+    std::vector<uint32_t> keys;
+    // positions in the timeline of the events of each category and channel
+    std::vector<uint32_t> lists[fmidi_timeline_categories][fmidi_timeline_channels];
+};
+
+static uint32_t fmidi_timeline_key(const fmidi_event_t *evt)
+{
+    uint32_t key = fmidi_event_category(evt) << 16;
+    if (evt->type == fmidi_event_message && (evt->data[0] >> 4) != 0xf)
+        key |= 1u << (evt->data[0] & 15);
+    return key;
+}
+
+static std::vector<uint32_t> &fmidi_timeline_list(fmidi_timeline_t *tl, uint32_t key)
+{
+    unsigned catno = 0;
+    while (catno + 1 < fmidi_timeline_categories && !(key & (1u << (16 + catno))))
+        ++catno;
+    unsigned channel = 0;
+    while (channel < 16 && !(key & (1u << channel)))
+        ++channel;
+    return tl->lists[catno][channel];
+}
+
+fmidi_timeline_t *fmidi_timeline_new(const fmidi_smf_t *smf)
+{
+    std::unique_ptr<fmidi_timeline_t> tl(new fmidi_timeline_t);
+    fmidi_seq_u seq(fmidi_seq_new(smf));
+
+    fmidi_seq_event_t sqevt;
+    while (fmidi_seq_next_event(seq.get(), &sqevt)) {
+        uint32_t key = fmidi_timeline_key(sqevt.event);
+        fmidi_timeline_list(tl.get(), key).push_back(tl->events.size());
+        tl->events.push_back(sqevt);
+        tl->keys.push_back(key);
+    }
+
+    tl->events.shrink_to_fit();
+    tl->keys.shrink_to_fit();
+    for (auto &bycategory : tl->lists) {
+        for (std::vector<uint32_t> &list : bycategory)
+            list.shrink_to_fit();
+    }
+    return tl.release();
+}
+
+void fmidi_timeline_free(fmidi_timeline_t *tl)
+{
+    delete tl;
+}
+
+size_t fmidi_timeline_size(const fmidi_timeline_t *tl)
+{
+    return tl->events.size();
+}
+
+// collects the positions in ascending order into runs of consecutive ones
+struct fmidi_span_builder {
+    fmidi_span_builder(const fmidi_seq_event_t *events, fmidi_span_t *out, size_t max)
+        : events(events), out(out), max(max) {}
+    const fmidi_seq_event_t *events;
+    fmidi_span_t *out;
+    size_t max;
+    size_t nspans = 0;
+    size_t start = 0, next = 0;
+
+    void add(size_t pos)
+    {
+        if (pos != next || nspans == 0) {
+            flush();
+            start = pos;
+            ++nspans;
+        }
+        next = pos + 1;
+    }
+    void flush()
+    {
+        if (nspans > 0 && nspans - 1 < max)
+            out[nspans - 1] = fmidi_span_t{&events[start], next - start};
+    }
+};
+
+size_t fmidi_query_range(
+    const fmidi_timeline_t *tl, double t0, double t1,
+    const fmidi_query_filter_t *filter, fmidi_span_t *out, size_t max)
+{
+    const std::vector<fmidi_seq_event_t> &events = tl->events;
+    auto before = [](const fmidi_seq_event_t &e, double t) { return e.time < t; };
+    size_t lo = std::lower_bound(events.begin(), events.end(), t0, before) - events.begin();
+    size_t hi = std::lower_bound(events.begin() + lo, events.end(), t1, before) - events.begin();
+
+    uint32_t typemask = filter ? filter->types : 0;
+    uint32_t chanmask = filter ? filter->channels : 0;
+    if (!typemask && !chanmask) {
+        if (lo == hi)
+            return 0;
+        if (max > 0)
+            out[0] = fmidi_span_t{&events[lo], hi - lo};
+        return 1;
+    }
+
+    typemask = typemask ? typemask : ~(uint32_t)0;
+    chanmask = chanmask ? chanmask : ~(uint32_t)0;
+
+    // the part of each selected list within the range
+    struct cursor { const uint32_t *cur, *end; };
+    cursor cursors[fmidi_timeline_categories * fmidi_timeline_channels];
+    unsigned ncursors = 0;
+    size_t found = 0;
+    for (unsigned catno = 0; catno < fmidi_timeline_categories; ++catno) {
+        if (!(typemask & (1u << catno)))
+            continue;
+        for (unsigned channel = 0; channel < fmidi_timeline_channels; ++channel) {
+            if (!(chanmask & (1u << channel)))
+                continue;
+            const std::vector<uint32_t> &list = tl->lists[catno][channel];
+            const uint32_t *cur = std::lower_bound(list.data(), list.data() + list.size(), lo);
+            const uint32_t *end = std::lower_bound(cur, list.data() + list.size(), hi);
+            if (cur != end)
+                cursors[ncursors++] = cursor{cur, end};
+            found += end - cur;
+        }
+    }
+
+    fmidi_span_builder spans(events.data(), out, max);
+
+    if (hi - lo < 8 * found) {
+        // most events pass, a scan is faster than the merge
+        const uint32_t *keys = tl->keys.data();
+        uint32_t keytypes = typemask << 16;
+        for (size_t i = lo; i < hi; ++i) {
+            if ((keys[i] & keytypes) && (keys[i] & chanmask))
+                spans.add(i);
+        }
+        spans.flush();
+        return spans.nspans;
+    }
+
+    // merge the lists in order of position, the earliest on top of the heap
+    auto later = [](const cursor &a, const cursor &b) { return *a.cur > *b.cur; };
+    std::make_heap(cursors, cursors + ncursors, later);
+
+    while (ncursors > 0) {
+        std::pop_heap(cursors, cursors + ncursors, later);
+        cursor &c = cursors[ncursors - 1];
+        // take from the earliest list up to the head of the next one
+        uint32_t bound = (ncursors > 1) ? *cursors[0].cur : ~(uint32_t)0;
+        for (; c.cur != c.end && *c.cur < bound; ++c.cur)
+            spans.add(*c.cur);
+        if (c.cur != c.end)
+            std::push_heap(cursors, cursors + ncursors, later);
+        else
+            --ncursors;
+    }
+    spans.flush();
+    return spans.nspans;
+}
+
+//------------------------------------------------------------------------------
+// Notes of each key are sorted by start, and form an implicit binary tree in
+// which the node at index i has the level of the trailing 1 bits of i. Each
+// node knows the maximum end of its subtree, which prunes the search.
+
+struct fmidi_note_tree {
+    std::vector<fmidi_note_t> notes;
+    std::vector<double> maxend;
+    unsigned levels = 0;
+};
+
+struct fmidi_note_index {
+    fmidi_note_tree key[128];
+    size_t size = 0;
+};
+
+static void fmidi_note_tree_build(fmidi_note_tree &tree)
+{
+    const std::vector<fmidi_note_t> &notes = tree.notes;
+    size_t n = notes.size();
+    std::vector<double> &maxend = tree.maxend;
+    maxend.resize(n);
+    if (n == 0)
+        return;
+
+    size_t lasti = 0;
+    double last = 0;
+    for (size_t i = 0; i < n; i += 2) {
+        lasti = i;
+        last = maxend[i] = notes[i].end;
+    }
+
+    unsigned k = 1;
+    for (; ((size_t)1 << k) <= n; ++k) {
+        size_t x = (size_t)1 << (k - 1);
+        for (size_t i = (x << 1) - 1; i < n; i += x << 2) {
+            double el = maxend[i - x];
+            double er = (i + x < n) ? maxend[i + x] : last;
+            maxend[i] = std::max(notes[i].end, std::max(el, er));
+        }
+        // move to the parent of the last node, which can be out of range
+        lasti = ((lasti >> k) & 1) ? (lasti - x) : (lasti + x);
+        if (lasti < n && maxend[lasti] > last)
+            last = maxend[lasti];
+    }
+    tree.levels = k - 1;
+}
+
+template <class Fn>
+static void fmidi_note_tree_overlap(
+    const fmidi_note_tree &tree, double t0, double t1, Fn &&fn)
+{
+    const fmidi_note_t *notes = tree.notes.data();
+    const double *maxend = tree.maxend.data();
+    size_t n = tree.notes.size();
+    if (n == 0)
+        return;
+
+    struct node { size_t x; unsigned k; bool right; };
+    node stack[64];
+    unsigned top = 0;
+    stack[top++] = node{((size_t)1 << tree.levels) - 1, tree.levels, false};
+
+    while (top > 0) {
+        node z = stack[--top];
+        if (z.k <= 3) {
+            // small subtree, scan it
+            size_t i0 = z.x >> z.k << z.k;
+            size_t i1 = std::min(i0 + ((size_t)1 << (z.k + 1)) - 1, n);
+            for (size_t i = i0; i < i1 && notes[i].start < t1; ++i) {
+                if (notes[i].end > t0)
+                    fn(notes[i]);
+            }
+        }
+        else if (!z.right) {
+            // revisit this node after its left subtree
+            size_t y = z.x - ((size_t)1 << (z.k - 1));
+            stack[top++] = node{z.x, z.k, true};
+            if (y >= n || maxend[y] > t0)
+                stack[top++] = node{y, z.k - 1, false};
+        }
+        else if (z.x < n && notes[z.x].start < t1) {
+            if (notes[z.x].end > t0)
+                fn(notes[z.x]);
+            stack[top++] = node{z.x + ((size_t)1 << (z.k - 1)), z.k - 1, false};
+        }
+    }
+}
+
+fmidi_note_index_t *fmidi_note_index_new(const fmidi_smf_t *smf)
+{
+    std::unique_ptr<fmidi_note_index_t> ni(new fmidi_note_index_t);
+    fmidi_seq_u seq(fmidi_seq_new(smf));
+
+    // notes sounding on each channel and key, the earliest first from the
+    // head, which are ended in the order they started
+    struct sounding_notes {
+        std::vector<size_t> notes;
+        size_t head = 0;
+    };
+    std::unique_ptr<sounding_notes[]> sounding(new sounding_notes[16 * 128]);
+
+    fmidi_seq_event_t sqevt;
+    double endtime = 0;
+    while (fmidi_seq_next_event(seq.get(), &sqevt)) {
+        const fmidi_event_t *evt = sqevt.event;
+        endtime = sqevt.time;
+        if (evt->type != fmidi_event_message || evt->datalen != 3)
+            continue;
+
+        unsigned status = evt->data[0] >> 4;
+        if (status != 0x8 && status != 0x9)
+            continue;
+
+        unsigned channel = evt->data[0] & 15;
+        unsigned key = evt->data[1] & 127;
+        unsigned velocity = evt->data[2];
+        fmidi_note_tree &tree = ni->key[key];
+        sounding_notes &slot = sounding[channel * 128 + key];
+
+        if (status == 0x9 && velocity != 0) {
+            fmidi_note_t note;
+            note.start = sqevt.time;
+            note.end = sqevt.time;
+            note.track = sqevt.track;
+            note.channel = channel;
+            note.key = key;
+            note.velocity = velocity;
+            slot.notes.push_back(tree.notes.size());
+            tree.notes.push_back(note);
+        }
+        else if (slot.head < slot.notes.size()) {
+            tree.notes[slot.notes[slot.head++]].end = sqevt.time;
+            if (slot.head == slot.notes.size()) {
+                slot.notes.clear();
+                slot.head = 0;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < 16 * 128; ++i) {
+        fmidi_note_tree &tree = ni->key[i % 128];
+        const sounding_notes &slot = sounding[i];
+        for (size_t j = slot.head; j < slot.notes.size(); ++j)
+            tree.notes[slot.notes[j]].end = endtime;
+    }
+
+    for (unsigned key = 0; key < 128; ++key) {
+        fmidi_note_tree &tree = ni->key[key];
+        tree.notes.shrink_to_fit();
+        fmidi_note_tree_build(tree);
+        ni->size += tree.notes.size();
+    }
+
+    return ni.release();
+}
+
+void fmidi_note_index_free(fmidi_note_index_t *ni)
+{
+    delete ni;
+}
+
+size_t fmidi_note_index_size(const fmidi_note_index_t *ni)
+{
+    return ni->size;
+}
+
+size_t fmidi_notes_at(
+    const fmidi_note_index_t *ni, double time, fmidi_note_t *out, size_t max)
+{
+    // the notes started no later than the time, and ending after it
+    double t1 = nextafter(time, HUGE_VAL);
+    return fmidi_notes_overlapping(ni, time, t1, 0, 127, out, max);
+}
+
+size_t fmidi_notes_overlapping(
+    const fmidi_note_index_t *ni, double t0, double t1,
+    unsigned keymin, unsigned keymax, fmidi_note_t *out, size_t max)
+{
+    size_t count = 0;
+    keymax = std::min(keymax, 127u);
+    for (unsigned key = keymin; key <= keymax; ++key) {
+        fmidi_note_tree_overlap(
+            ni->key[key], t0, t1,
+            [out, max, &count](const fmidi_note_t &note) {
+                if (count < max)
+                    out[count] = note;
+                ++count;
+            });
+    }
+    return count;
+}
+
+//------------------------------------------------------------------------------
+struct fmidi_text_index {
+    std::vector<fmidi_text_entry_t> entries;
+    std::vector<char> arena;
+    std::vector<uint32_t> bytype[16];  // positions of the entries of a type
+};
+
+fmidi_text_index_t *fmidi_text_index_new(const fmidi_smf_t *smf)
+{
+    std::unique_ptr<fmidi_text_index_t> ti(new fmidi_text_index_t);
+    fmidi_seq_u seq(fmidi_seq_new(smf));
+
+    // each track followed up to the latest text, for the ticks
+    unsigned ntracks = smf->info.track_count;
+    std::unique_ptr<fmidi_track_iter_t[]> iters(new fmidi_track_iter_t[ntracks]);
+    std::unique_ptr<uint64_t[]> ticks(new uint64_t[ntracks]());
+    for (unsigned i = 0; i < ntracks; ++i)
+        fmidi_smf_track_begin(&iters[i], i);
+
+    std::vector<uint32_t> offsets;
+    fmidi_seq_event_t sqevt;
+    while (fmidi_seq_next_event(seq.get(), &sqevt)) {
+        const fmidi_event_t *evt = sqevt.event;
+        if (evt->type != fmidi_event_meta)
+            continue;
+        unsigned type = evt->data[0];
+        if (type < 0x01 || type > 0x0f)
+            continue;
+
+        unsigned trkno = sqevt.track;
+        const fmidi_event_t *trkevt;
+        while ((trkevt = fmidi_smf_track_next(smf, &iters[trkno]))) {
+            ticks[trkno] += trkevt->delta;
+            if (trkevt == evt)
+                break;
+        }
+
+        fmidi_text_entry_t entry;
+        entry.tick = ticks[trkno];
+        entry.time = sqevt.time;
+        entry.track = trkno;
+        entry.type = type;
+        entry.text = nullptr;
+        entry.length = evt->datalen - 1;
+        ti->bytype[type].push_back(ti->entries.size());
+        ti->entries.push_back(entry);
+
+        offsets.push_back(ti->arena.size());
+        ti->arena.insert(ti->arena.end(), &evt->data[1], &evt->data[evt->datalen]);
+        ti->arena.push_back('\0');
+    }
+
+    ti->arena.shrink_to_fit();
+    ti->entries.shrink_to_fit();
+    for (size_t i = 0, n = ti->entries.size(); i < n; ++i)
+        ti->entries[i].text = &ti->arena[offsets[i]];
+
+    return ti.release();
+}
+
+void fmidi_text_index_free(fmidi_text_index_t *ti)
+{
+    delete ti;
+}
+
+size_t fmidi_text_index_size(const fmidi_text_index_t *ti)
+{
+    return ti->entries.size();
+}
+
+const fmidi_text_entry_t *fmidi_text_entry(const fmidi_text_index_t *ti, size_t index)
+{
+    return (index < ti->entries.size()) ? &ti->entries[index] : nullptr;
+}
+
+const fmidi_text_entry_t *fmidi_text_at_time(
+    const fmidi_text_index_t *ti, double time, uint32_t types)
+{
+    const fmidi_text_entry_t *entries = ti->entries.data();
+    const fmidi_text_entry_t *found = nullptr;
+    for (unsigned type = 1; type < 16; ++type) {
+        if (!(types & (1u << type)))
+            continue;
+        const std::vector<uint32_t> &list = ti->bytype[type];
+        auto it = std::upper_bound(
+            list.begin(), list.end(), time,
+            [entries](double time, uint32_t i) { return time < entries[i].time; });
+        if (it != list.begin() && (!found || &entries[*(it - 1)] > found))
+            found = &entries[*(it - 1)];
+    }
+    return found;
+}
+
+const fmidi_text_entry_t *fmidi_text_after_time(
+    const fmidi_text_index_t *ti, double time, uint32_t types)
+{
+    const fmidi_text_entry_t *entries = ti->entries.data();
+    const fmidi_text_entry_t *found = nullptr;
+    for (unsigned type = 1; type < 16; ++type) {
+        if (!(types & (1u << type)))
+            continue;
+        const std::vector<uint32_t> &list = ti->bytype[type];
+        auto it = std::upper_bound(
+            list.begin(), list.end(), time,
+            [entries](double time, uint32_t i) { return time < entries[i].time; });
+        if (it != list.end() && (!found || &entries[*it] < found))
+            found = &entries[*it];
+    }
+    return found;
+}
@@ -0,0 +1,121 @@
+//          Copyright Jean Pierre Cimalando 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE.md or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
+#include "fmidi/fmidi_internal.h"
+#include "fmidi/u_memstream.h"
+
+struct fmidi_resident {
+    fmidi_smf_info_t info;
+    std::vector<uint8_t> data;  // bodies of the track chunks
+    std::vector<uint32_t> offset;  // start of each track, and end of the last
+};
+
+struct fmidi_resident_iter {
+    fmidi_resident_iter(const uint8_t *data, size_t length)
+        : mb(data, length) {}
+    memstream mb;
+    uint8_t runstatus = 0;
+    bool endoftrack = false;
+    std::vector<uint8_t> evbuf;  // the current event
+};
+
+// decoding stops at the end of track, as a reader of the file would
+static bool fmidi_resident_track_end(const fmidi_event_t *evt)
+{
+    return evt->type == fmidi_event_meta && evt->data[0] == 0x2f;
+}
+
+fmidi_resident_t *fmidi_resident_new(const fmidi_smf_t *smf)
+{
+    std::unique_ptr<fmidi_resident_t> res(new fmidi_resident_t);
+    unsigned ntracks = smf->info.track_count;
+    res->info = smf->info;
+    res->offset.reserve(ntracks + 1);
+
+    Memory_Writer writer(res->data);
+    for (unsigned i = 0; i < ntracks; ++i) {
+        res->offset.push_back(res->data.size());
+        fmidi_smf_write_track(smf, i, writer);
+    }
+    res->offset.push_back(res->data.size());
+
+    res->data.shrink_to_fit();
+    return res.release();
+}
+
+void fmidi_resident_free(fmidi_resident_t *res)
+{
+    delete res;
+}
+
+const fmidi_smf_info_t *fmidi_resident_get_info(const fmidi_resident_t *res)
+{
+    return &res->info;
+}
+
+size_t fmidi_resident_size(const fmidi_resident_t *res)
+{
+    return sizeof(fmidi_resident_t) + res->data.capacity() +
+        res->offset.capacity() * sizeof(uint32_t);
+}
+
+fmidi_smf_t *fmidi_resident_load(const fmidi_resident_t *res)
+{
+    unsigned ntracks = res->info.track_count;
+    fmidi_smf_u smf(new fmidi_smf_t);
+    smf->info = res->info;
+    smf->track.reset(new fmidi_raw_track[ntracks]);
+
+    std::vector<uint8_t> evbuf;
+    evbuf.reserve(8192);
+
+    for (unsigned i = 0; i < ntracks; ++i) {
+        const uint8_t *data = res->data.data() + res->offset[i];
+        memstream mb(data, res->offset[i + 1] - res->offset[i]);
+        uint8_t runstatus = 0;
+        evbuf.clear();
+        for (bool endoftrack = false; !endoftrack && mb.getpos() < mb.endpos();) {
+            const fmidi_event_t *evt = fmidi_smf_read_event(mb, evbuf, &runstatus);
+            if (!evt)
+                return nullptr;
+            endoftrack = fmidi_resident_track_end(evt);
+        }
+        fmidi_track_store(smf->track[i], evbuf);
+    }
+
+    return smf.release();
+}
+
+fmidi_resident_iter_t *fmidi_resident_iter_new(
+    const fmidi_resident_t *res, uint16_t track)
+{
+    if (track >= res->info.track_count)
+        RET_FAIL(nullptr, fmidi_err_input);
+
+    const uint8_t *data = res->data.data() + res->offset[track];
+    fmidi_resident_iter_t *it = new fmidi_resident_iter_t(
+        data, res->offset[track + 1] - res->offset[track]);
+    it->evbuf.reserve(256);
+    return it;
+}
+
+void fmidi_resident_iter_free(fmidi_resident_iter_t *it)
+{
+    delete it;
+}
+
+const fmidi_event_t *fmidi_resident_iter_next(fmidi_resident_iter_t *it)
+{
+    memstream &mb = it->mb;
+    if (it->endoftrack || mb.getpos() == mb.endpos())
+        return nullptr;
+
+    it->evbuf.clear();
+    const fmidi_event_t *evt = fmidi_smf_read_event(mb, it->evbuf, &it->runstatus);
+    it->endoftrack = evt && fmidi_resident_track_end(evt);
+    return evt;
+}
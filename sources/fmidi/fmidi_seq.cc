@@ -4,12 +4,19 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include "fmidi/fmidi.h"
+#include "fmidi/fmidi_util.h"
+#include "fmidi/fmidi_internal.h"
+#include <algorithm>
 #include <memory>
+#include <vector>
+#include <math.h>
 #include <string.h>
 
 struct fmidi_seq_timing {
     fmidi_smpte startoffset;
     uint32_t tempo;
+    // built on the first seek, and shared by the clones
+    std::shared_ptr<const std::vector<fmidi_tempo_change>> tempomap;
 };
 
 struct fmidi_seq_pending_event {
@@ -17,16 +24,37 @@ struct fmidi_seq_pending_event {
     double delta;
 };
 
+enum {
+    fmidi_seq_mute = 1 << 0,
+    fmidi_seq_solo = 1 << 1,
+};
+
 struct fmidi_seq_track_info {
     double timepos;
     fmidi_track_iter_t iter;
     fmidi_seq_pending_event next;
     std::shared_ptr<fmidi_seq_timing> timing;
+    uint8_t mask = 0;  // mute and solo
+    bool silent = false;  // in the merge for its tempo only
+    // contents of the track, scanned when masks are first set
+    uint16_t channels = 0;  // bit set of channels of messages
+    bool tempo = false;  // has tempo changes
+    bool other = false;  // has events other than channel messages
 };
 
 struct fmidi_seq {
     const fmidi_smf_t *smf;
     std::unique_ptr<fmidi_seq_track_info[]> track;
+    std::vector<uint16_t> active;  // tracks in the merge, in order
+    // positions of the events, if the song has no index, built on the first
+    // step backward and shared by the clones
+    std::shared_ptr<const std::vector<fmidi_track_index>> index;
+    double timepos = 0;  // time of the last event
+    bool mapped = false;  // whether the tempo maps are built
+    bool scanned = false;  // whether the tracks are scanned
+    bool masked = false;  // whether some events are hidden
+    unsigned solo = 0;  // count of soloed tracks
+    uint16_t channels = 0xffff;  // bit set of channels played
 };
 
 static double fmidi_convert_delta(
@@ -59,6 +87,10 @@ fmidi_seq_t *fmidi_seq_new(const fmidi_smf_t *smf)
         track.timing = timing;
     }
 
+    seq->active.resize(ntracks);
+    for (unsigned i = 0; i < ntracks; ++i)
+        seq->active[i] = i;
+
     fmidi_seq_rewind(seq.get());
     return seq.release();
 }
@@ -110,6 +142,8 @@ void fmidi_seq_rewind(fmidi_seq_t *seq)
         }
         track.timepos = fmidi_smpte_time(&startoffset);
     }
+
+    seq->timepos = 0;
 }
 
 static fmidi_seq_pending_event *fmidi_seq_track_current_event(
@@ -140,22 +174,24 @@ static fmidi_seq_pending_event *fmidi_seq_track_current_event(
 
 static int fmidi_seq_next_track(fmidi_seq_t *seq)
 {
-    const fmidi_smf_info_t *info = fmidi_smf_get_info(seq->smf);
-    unsigned ntracks = info->track_count;
+    const uint16_t *active = seq->active.data();
+    unsigned nactive = seq->active.size();
 
-    unsigned trkno = 0;
-    fmidi_seq_pending_event *pevt;
+    unsigned index = 0;
+    fmidi_seq_pending_event *pevt = nullptr;
 
-    pevt = fmidi_seq_track_current_event(seq, 0);
-    while (!pevt && ++trkno < ntracks)
-        pevt = fmidi_seq_track_current_event(seq, trkno);
+    while (index < nactive &&
+           !(pevt = fmidi_seq_track_current_event(seq, active[index])))
+        ++index;
 
     if (!pevt)
         return -1;
 
+    unsigned trkno = active[index];
     double nearest = fmidi_convert_delta(seq, trkno, pevt->delta) +
         seq->track[trkno].timepos;
-    for (unsigned i = trkno + 1; i < ntracks; ++i) {
+    for (unsigned j = index + 1; j < nactive; ++j) {
+        unsigned i = active[j];
         if ((pevt = fmidi_seq_track_current_event(seq, i))) {
             double time = fmidi_convert_delta(seq, i, pevt->delta) +
                 seq->track[i].timepos;
@@ -169,7 +205,7 @@ static int fmidi_seq_next_track(fmidi_seq_t *seq)
     return trkno;
 }
 
-bool fmidi_seq_peek_event(fmidi_seq_t *seq, fmidi_seq_event_t *sqevt)
+static bool fmidi_seq_peek_any_event(fmidi_seq_t *seq, fmidi_seq_event_t *sqevt)
 {
     unsigned trkno = fmidi_seq_next_track(seq);
     if ((int)trkno == -1)
@@ -206,25 +242,16 @@ static void fmidi_seq_track_advance_by(
     trk.timepos += time;
 }
 
-bool fmidi_seq_next_event(fmidi_seq_t *seq, fmidi_seq_event_t *sqevt)
+static void fmidi_seq_consume_event(fmidi_seq_t *seq, const fmidi_seq_event_t *sqevt)
 {
-    fmidi_seq_event_t pltmp;
-    sqevt = sqevt ? sqevt : &pltmp;
-
-    if (!fmidi_seq_peek_event(seq, sqevt))
-        return false;
-
     double time = sqevt->time;
     unsigned trkno = sqevt->track;
     const fmidi_event_t *evt = sqevt->event;
     fmidi_seq_track_info &trk = seq->track[trkno];
 
-    const fmidi_smf_t *smf = seq->smf;
-    const fmidi_smf_info_t *info = fmidi_smf_get_info(smf);
-    unsigned ntracks = info->track_count;
     double elapsed = time - trk.timepos;
 
-    for (unsigned i = 0; i < ntracks; ++i)
+    for (uint16_t i : seq->active)
         if (i != trkno)
             fmidi_seq_track_advance_by(seq, i, elapsed);
 
@@ -237,5 +264,479 @@ bool fmidi_seq_next_event(fmidi_seq_t *seq, fmidi_seq_event_t *sqevt)
 
     trk.timepos = time;
     trk.next.event = nullptr;
+    seq->timepos = time;
+}
+
+// whether the event is dropped by the masks
+static bool fmidi_seq_event_hidden(const fmidi_seq_t *seq, const fmidi_seq_event_t *sqevt)
+{
+    if (seq->track[sqevt->track].silent)
+        return true;
+    const fmidi_event_t *evt = sqevt->event;
+    if (evt->type != fmidi_event_message || evt->datalen < 1)
+        return false;
+    uint8_t status = evt->data[0];
+    return status < 0xf0 && !(seq->channels & (1u << (status & 15)));
+}
+
+bool fmidi_seq_peek_event(fmidi_seq_t *seq, fmidi_seq_event_t *sqevt)
+{
+    fmidi_seq_event_t pltmp;
+    sqevt = sqevt ? sqevt : &pltmp;
+
+    if (!seq->masked)
+        return fmidi_seq_peek_any_event(seq, sqevt);
+
+    // hidden events are consumed, so tempo changes still apply
+    while (fmidi_seq_peek_any_event(seq, sqevt)) {
+        if (!fmidi_seq_event_hidden(seq, sqevt))
+            return true;
+        fmidi_seq_consume_event(seq, sqevt);
+    }
+    return false;
+}
+
+bool fmidi_seq_next_event(fmidi_seq_t *seq, fmidi_seq_event_t *sqevt)
+{
+    fmidi_seq_event_t pltmp;
+    sqevt = sqevt ? sqevt : &pltmp;
+
+    if (!fmidi_seq_peek_event(seq, sqevt))
+        return false;
+
+    fmidi_seq_consume_event(seq, sqevt);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static void fmidi_seq_build_tempo_maps(fmidi_seq_t *seq)
+{
+    const fmidi_smf_t *smf = seq->smf;
+    const fmidi_smf_info_t *info = fmidi_smf_get_info(smf);
+    unsigned ntracks = info->track_count;
+
+    // tracks share the timing of the first, except in format 2
+    bool shared = info->format != 2;
+    for (unsigned i = 0, n = shared ? 1 : ntracks; i < n; ++i) {
+        std::shared_ptr<std::vector<fmidi_tempo_change>> map(
+            new std::vector<fmidi_tempo_change>);
+        fmidi_tempo_map_build(smf, i, shared ? ntracks : 1, *map);
+        seq->track[i].timing->tempomap = map;
+    }
+
+    seq->mapped = true;
+}
+
+static void fmidi_seq_track_seek(fmidi_seq_t *seq, unsigned trkno, double tick)
+{
+    const fmidi_smf_t *smf = seq->smf;
+    uint16_t unit = fmidi_smf_get_info(smf)->delta_unit;
+    fmidi_seq_track_info &trk = seq->track[trkno];
+    fmidi_seq_timing &tim = *trk.timing;
+
+    const fmidi_tempo_change &tc = fmidi_tempo_at_tick(*tim.tempomap, tick);
+    tim.tempo = tc.tempo;
+    trk.timepos = fmidi_smpte_time(&tim.startoffset) + tc.time +
+        fmidi_delta_time(tick - tc.tick, unit, tc.tempo);
+
+    // the first event at or after the tick becomes pending, unless it ends
+    // the track
+    uint64_t evtick = fmidi_track_seek_tick(smf, &trk.iter, trkno, (uint64_t)ceil(tick));
+    trk.next.event = nullptr;
+
+    fmidi_track_iter_t it = trk.iter;
+    const fmidi_event_t *evt = fmidi_smf_track_next(smf, &it);
+    if (evt && !(evt->type == fmidi_event_meta &&
+                 (evt->data[0] == 0x2f || evt->data[0] == 0x3f))) {
+        trk.iter = it;
+        trk.next.event = evt;
+        trk.next.delta = evtick - tick;
+    }
+}
+
+static double fmidi_seq_track_tick(const fmidi_seq_t *seq, unsigned trkno, double time)
+{
+    uint16_t unit = fmidi_smf_get_info(seq->smf)->delta_unit;
+    const fmidi_seq_timing &tim = *seq->track[trkno].timing;
+    double reltime = time - fmidi_smpte_time(&tim.startoffset);
+    double tick = 0;
+    if (reltime > 0) {
+        const fmidi_tempo_change &tc = fmidi_tempo_at_time(*tim.tempomap, reltime);
+        tick = tc.tick + fmidi_time_delta(reltime - tc.time, unit, tc.tempo);
+        // do not miss an event at this exact time by rounding error
+        double nearest = floor(tick + 0.5);
+        if (fabs(tick - nearest) < 1e-6)
+            tick = nearest;
+    }
+    return tick;
+}
+
+void fmidi_seq_seek_time(fmidi_seq_t *seq, double time)
+{
+    const fmidi_smf_info_t *info = fmidi_smf_get_info(seq->smf);
+    unsigned ntracks = info->track_count;
+
+    if (!seq->mapped)
+        fmidi_seq_build_tempo_maps(seq);
+    fmidi_seq_rewind(seq);
+
+    for (unsigned i = 0; i < ntracks; ++i)
+        fmidi_seq_track_seek(seq, i, fmidi_seq_track_tick(seq, i, time));
+    seq->timepos = time;
+}
+
+void fmidi_seq_seek_tick(fmidi_seq_t *seq, uint64_t tick)
+{
+    const fmidi_smf_info_t *info = fmidi_smf_get_info(seq->smf);
+    unsigned ntracks = info->track_count;
+
+    if (!seq->mapped)
+        fmidi_seq_build_tempo_maps(seq);
+    fmidi_seq_rewind(seq);
+
+    for (unsigned i = 0; i < ntracks; ++i)
+        fmidi_seq_track_seek(seq, i, tick);
+    if (ntracks > 0)
+        seq->timepos = seq->track[0].timepos;
+}
+
+//------------------------------------------------------------------------------
+static const fmidi_track_index &fmidi_seq_track_index(fmidi_seq_t *seq, unsigned trkno)
+{
+    const fmidi_smf_t *smf = seq->smf;
+    if (smf->index)
+        return smf->index[trkno];
+
+    if (!seq->index) {
+        unsigned ntracks = fmidi_smf_get_info(smf)->track_count;
+        std::shared_ptr<std::vector<fmidi_track_index>> index(
+            new std::vector<fmidi_track_index>(ntracks));
+        fmidi_parallel_for(ntracks, [smf, &index](unsigned i) {
+            fmidi_track_index_build((*index)[i], smf->track[i]);
+        });
+        seq->index = index;
+    }
+    return (*seq->index)[trkno];
+}
+
+static bool fmidi_seq_event_ends_track(const fmidi_event_t *evt)
+{
+    return evt->type == fmidi_event_meta &&
+        (evt->data[0] == 0x2f || evt->data[0] == 0x3f);
+}
+
+static double fmidi_seq_tick_time(const fmidi_seq_t *seq, unsigned trkno, double tick)
+{
+    uint16_t unit = fmidi_smf_get_info(seq->smf)->delta_unit;
+    const fmidi_seq_timing &tim = *seq->track[trkno].timing;
+    const fmidi_tempo_change &tc = fmidi_tempo_at_tick(*tim.tempomap, tick);
+    return fmidi_smpte_time(&tim.startoffset) + tc.time +
+        fmidi_delta_time(tick - tc.tick, unit, tc.tempo);
+}
+
+// number of the next event of the track, pending or not
+static uint32_t fmidi_seq_track_cursor(fmidi_seq_t *seq, unsigned trkno)
+{
+    const fmidi_track_index &idx = fmidi_seq_track_index(seq, trkno);
+    const fmidi_seq_track_info &trk = seq->track[trkno];
+    uint32_t number = std::lower_bound(
+        idx.offset.begin(), idx.offset.end(), trk.iter.index) - idx.offset.begin();
+    return trk.next.event ? number - 1 : number;
+}
+
+// number of the event before the next one of the track, other than its end
+static bool fmidi_seq_track_previous(fmidi_seq_t *seq, unsigned trkno, uint32_t *number)
+{
+    const fmidi_raw_track &raw = seq->smf->track[trkno];
+    const fmidi_track_index &idx = fmidi_seq_track_index(seq, trkno);
+    for (uint32_t i = fmidi_seq_track_cursor(seq, trkno); i-- > 0;) {
+        const fmidi_event_t *evt = (const fmidi_event_t *)&raw.data.get()[idx.offset[i]];
+        if (!fmidi_seq_event_ends_track(fmidi_track_resolve(raw, evt))) {
+            *number = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// make the event of the number pending, at the given tick and time
+static void fmidi_seq_track_place(
+    fmidi_seq_t *seq, unsigned trkno, uint32_t number, double tick, double time)
+{
+    const fmidi_smf_t *smf = seq->smf;
+    const fmidi_track_index &idx = fmidi_seq_track_index(seq, trkno);
+    fmidi_seq_track_info &trk = seq->track[trkno];
+    fmidi_seq_timing &tim = *trk.timing;
+
+    tim.tempo = fmidi_tempo_at_tick(*tim.tempomap, tick).tempo;
+    trk.timepos = time;
+    trk.next.event = nullptr;
+
+    fmidi_smf_track_begin(&trk.iter, trkno);
+    if (number >= idx.offset.size()) {
+        trk.iter.index = smf->track[trkno].length;
+        return;
+    }
+    trk.iter.index = idx.offset[number];
+
+    fmidi_track_iter_t it = trk.iter;
+    const fmidi_event_t *evt = fmidi_smf_track_next(smf, &it);
+    if (evt && !fmidi_seq_event_ends_track(evt)) {
+        trk.iter = it;
+        trk.next.event = evt;
+        trk.next.delta = idx.tick[number] - tick;
+    }
+}
+
+bool fmidi_seq_prev_event(fmidi_seq_t *seq, fmidi_seq_event_t *sqevt)
+{
+    fmidi_seq_event_t pltmp;
+    sqevt = sqevt ? sqevt : &pltmp;
+
+    if (!seq->mapped)
+        fmidi_seq_build_tempo_maps(seq);
+
+    for (;;) {
+        // the latest of the previous events of the tracks, and the one of
+        // the higher track at equal times, which the merge returns last
+        int trkno = -1;
+        uint32_t number = 0;
+        double latest = 0;
+        for (uint16_t i : seq->active) {
+            uint32_t j;
+            if (!fmidi_seq_track_previous(seq, i, &j))
+                continue;
+            double time = fmidi_seq_tick_time(seq, i, fmidi_seq_track_index(seq, i).tick[j]);
+            if (trkno == -1 || time >= latest) {
+                trkno = i;
+                number = j;
+                latest = time;
+            }
+        }
+        if (trkno == -1)
+            return false;
+
+        // the event becomes pending, and the other tracks are timed from it
+        const fmidi_seq_timing *tim = seq->track[trkno].timing.get();
+        uint64_t tick = fmidi_seq_track_index(seq, trkno).tick[number];
+        for (uint16_t i : seq->active) {
+            double trktick = (seq->track[i].timing.get() == tim) ?
+                tick : fmidi_seq_track_tick(seq, i, latest);
+            uint32_t j = (i == (unsigned)trkno) ? number : fmidi_seq_track_cursor(seq, i);
+            fmidi_seq_track_place(seq, i, j, trktick, latest);
+        }
+        seq->timepos = latest;
+
+        sqevt->time = latest;
+        sqevt->track = trkno;
+        sqevt->event = seq->track[trkno].next.event;
+        if (!seq->masked || !fmidi_seq_event_hidden(seq, sqevt))
+            return true;
+    }
+}
+
+//------------------------------------------------------------------------------
+static void fmidi_seq_scan_tracks(fmidi_seq_t *seq)
+{
+    const fmidi_smf_t *smf = seq->smf;
+    unsigned ntracks = fmidi_smf_get_info(smf)->track_count;
+
+    fmidi_parallel_for(ntracks, [seq, smf](unsigned i) {
+        fmidi_seq_track_info &trk = seq->track[i];
+        fmidi_track_iter_t it;
+        fmidi_smf_track_begin(&it, i);
+        for (const fmidi_event_t *evt; (evt = fmidi_smf_track_next(smf, &it));) {
+            uint8_t id = (evt->datalen > 0) ? evt->data[0] : 0;
+            if (evt->type == fmidi_event_message && id >= 0x80 && id < 0xf0)
+                trk.channels |= 1u << (id & 15);
+            else if (evt->type == fmidi_event_meta && (id == 0x2f || id == 0x3f))
+                continue;
+            else {
+                trk.other = true;
+                if (evt->type == fmidi_event_meta && id == 0x51)
+                    trk.tempo = true;
+            }
+        }
+    });
+
+    seq->scanned = true;
+}
+
+// rebuild the merge after a change of the masks
+static void fmidi_seq_update_masks(fmidi_seq_t *seq)
+{
+    unsigned ntracks = fmidi_smf_get_info(seq->smf)->track_count;
+
+    if (!seq->scanned)
+        fmidi_seq_scan_tracks(seq);
+
+    std::vector<bool> was(ntracks);
+    for (uint16_t i : seq->active)
+        was[i] = true;
+
+    seq->active.clear();
+    seq->masked = seq->channels != 0xffff;
+    for (unsigned i = 0; i < ntracks; ++i) {
+        fmidi_seq_track_info &trk = seq->track[i];
+        bool audible = seq->solo ? (trk.mask & fmidi_seq_solo) : !(trk.mask & fmidi_seq_mute);
+        bool sounding = audible && ((trk.channels & seq->channels) || trk.other);
+        // tracks which are heard only for their tempo stay in the merge
+        trk.silent = !sounding && trk.tempo;
+        if (!sounding && !trk.tempo) {
+            seq->masked = true;
+            continue;
+        }
+        seq->masked = seq->masked || trk.silent;
+
+        // tracks left behind are brought to the current time
+        if (!was[i]) {
+            if (!seq->mapped)
+                fmidi_seq_build_tempo_maps(seq);
+            fmidi_seq_track_seek(seq, i, fmidi_seq_track_tick(seq, i, seq->timepos));
+        }
+        seq->active.push_back(i);
+    }
+}
+
+void fmidi_seq_mute_track(fmidi_seq_t *seq, uint16_t track, bool mute)
+{
+    if (track >= fmidi_smf_get_info(seq->smf)->track_count)
+        return;
+    uint8_t &mask = seq->track[track].mask;
+    mask = mute ? (mask | fmidi_seq_mute) : (mask & ~fmidi_seq_mute);
+    fmidi_seq_update_masks(seq);
+}
+
+void fmidi_seq_solo_track(fmidi_seq_t *seq, uint16_t track, bool solo)
+{
+    if (track >= fmidi_smf_get_info(seq->smf)->track_count)
+        return;
+    uint8_t &mask = seq->track[track].mask;
+    if (solo && !(mask & fmidi_seq_solo))
+        ++seq->solo;
+    else if (!solo && (mask & fmidi_seq_solo))
+        --seq->solo;
+    mask = solo ? (mask | fmidi_seq_solo) : (mask & ~fmidi_seq_solo);
+    fmidi_seq_update_masks(seq);
+}
+
+void fmidi_seq_set_channel_mask(fmidi_seq_t *seq, uint16_t channels)
+{
+    seq->channels = channels;
+    fmidi_seq_update_masks(seq);
+}
+
+//------------------------------------------------------------------------------
+fmidi_seq_t *fmidi_seq_clone(const fmidi_seq_t *seq)
+{
+    const fmidi_smf_info_t *info = fmidi_smf_get_info(seq->smf);
+    uint16_t ntracks = info->track_count;
+
+    std::unique_ptr<fmidi_seq_t> copy(new fmidi_seq_t);
+    copy->smf = seq->smf;
+    copy->track.reset(new fmidi_seq_track_info[ntracks]);
+    copy->active = seq->active;
+    copy->index = seq->index;
+    copy->timepos = seq->timepos;
+    copy->mapped = seq->mapped;
+    copy->scanned = seq->scanned;
+    copy->masked = seq->masked;
+    copy->solo = seq->solo;
+    copy->channels = seq->channels;
+
+    for (unsigned i = 0; i < ntracks; ++i) {
+        const fmidi_seq_track_info &from = seq->track[i];
+        fmidi_seq_track_info &to = copy->track[i];
+        to.timepos = from.timepos;
+        to.iter = from.iter;
+        to.next = from.next;
+        to.mask = from.mask;
+        to.silent = from.silent;
+        to.channels = from.channels;
+        to.tempo = from.tempo;
+        to.other = from.other;
+        // keep the sharing of the timing between tracks
+        if (i > 0 && from.timing == seq->track[0].timing)
+            to.timing = copy->track[0].timing;
+        else
+            to.timing.reset(new fmidi_seq_timing(*from.timing));
+    }
+
+    return copy.release();
+}
+
+struct fmidi_seq_state_header {
+    const fmidi_smf_t *smf;
+    uint32_t track_count;
+    double timepos;
+};
+
+struct fmidi_seq_track_state {
+    double timepos;
+    uint32_t index;
+    uint32_t tempo;
+    const fmidi_event_t *event;  // pending, or null
+    double delta;
+    fmidi_smpte startoffset;
+};
+
+size_t fmidi_seq_state_size(const fmidi_seq_t *seq)
+{
+    const fmidi_smf_info_t *info = fmidi_smf_get_info(seq->smf);
+    return sizeof(fmidi_seq_state_header) +
+        info->track_count * sizeof(fmidi_seq_track_state);
+}
+
+bool fmidi_seq_save_state(const fmidi_seq_t *seq, void *mem, size_t size)
+{
+    const fmidi_smf_info_t *info = fmidi_smf_get_info(seq->smf);
+    uint16_t ntracks = info->track_count;
+    if (size < fmidi_seq_state_size(seq))
+        RET_FAIL(false, fmidi_err_output);
+
+    fmidi_seq_state_header *hdr = (fmidi_seq_state_header *)mem;
+    hdr->smf = seq->smf;
+    hdr->track_count = ntracks;
+    hdr->timepos = seq->timepos;
+
+    fmidi_seq_track_state *st = (fmidi_seq_track_state *)(hdr + 1);
+    for (unsigned i = 0; i < ntracks; ++i) {
+        const fmidi_seq_track_info &trk = seq->track[i];
+        st[i].timepos = trk.timepos;
+        st[i].index = trk.iter.index;
+        st[i].tempo = trk.timing->tempo;
+        st[i].event = trk.next.event;
+        st[i].delta = trk.next.delta;
+        st[i].startoffset = trk.timing->startoffset;
+    }
+
+    return true;
+}
+
+bool fmidi_seq_restore_state(fmidi_seq_t *seq, const void *mem, size_t size)
+{
+    const fmidi_smf_info_t *info = fmidi_smf_get_info(seq->smf);
+    uint16_t ntracks = info->track_count;
+
+    // the state refers to the events of the song it was saved from
+    const fmidi_seq_state_header *hdr = (const fmidi_seq_state_header *)mem;
+    if (size < fmidi_seq_state_size(seq) ||
+        hdr->smf != seq->smf || hdr->track_count != ntracks)
+        RET_FAIL(false, fmidi_err_input);
+
+    seq->timepos = hdr->timepos;
+
+    const fmidi_seq_track_state *st = (const fmidi_seq_track_state *)(hdr + 1);
+    for (unsigned i = 0; i < ntracks; ++i) {
+        fmidi_seq_track_info &trk = seq->track[i];
+        trk.timepos = st[i].timepos;
+        fmidi_smf_track_begin(&trk.iter, i);
+        trk.iter.index = st[i].index;
+        trk.timing->tempo = st[i].tempo;
+        trk.timing->startoffset = st[i].startoffset;
+        trk.next.event = st[i].event;
+        trk.next.delta = st[i].delta;
+    }
+
     return true;
 }
@@ -10,7 +10,12 @@
 #include <fmt/format.h>
 #include <fmt/ostream.h>
 #endif
+#include <algorithm>
+#include <atomic>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <string.h>
 
 double fmidi_smpte_time(const fmidi_smpte *smpte)
 {
@@ -80,6 +85,257 @@ unsigned fmidi_message_sizeof(uint8_t id)
     }
 }
 
+void fmidi_tempo_map_build(
+    const fmidi_smf_t *smf, unsigned first, unsigned count,
+    std::vector<fmidi_tempo_change> &map)
+{
+    uint16_t unit = smf->info.delta_unit;
+    map.assign(1, fmidi_tempo_change{0, 0, 500000});
+
+    for (unsigned i = first; i < first + count; ++i) {
+        const fmidi_event_t *evt;
+        fmidi_track_iter_t it;
+        fmidi_smf_track_begin(&it, i);
+        uint64_t tick = 0;
+        while ((evt = fmidi_smf_track_next(smf, &it))) {
+            tick += evt->delta;
+            if (evt->type == fmidi_event_meta &&
+                evt->data[0] == 0x51 && evt->datalen == 4) {  // set tempo
+                const uint8_t *d24 = &evt->data[1];
+                uint32_t tempo = (d24[0] << 16) | (d24[1] << 8) | d24[2];
+                map.push_back(fmidi_tempo_change{tick, 0, tempo});
+            }
+        }
+    }
+
+    std::stable_sort(
+        map.begin(), map.end(),
+        [](const fmidi_tempo_change &a, const fmidi_tempo_change &b)
+            { return a.tick < b.tick; });
+    for (size_t j = 1, n = map.size(); j < n; ++j) {
+        const fmidi_tempo_change &prev = map[j - 1];
+        map[j].time = prev.time + fmidi_delta_time(
+            map[j].tick - prev.tick, unit, prev.tempo);
+    }
+}
+
+const fmidi_tempo_change &fmidi_tempo_at_tick(
+    const std::vector<fmidi_tempo_change> &map, double tick)
+{
+    auto it = std::upper_bound(
+        map.begin() + 1, map.end(), tick,
+        [](double tick, const fmidi_tempo_change &tc) { return tick < tc.tick; });
+    return *(it - 1);
+}
+
+const fmidi_tempo_change &fmidi_tempo_at_time(
+    const std::vector<fmidi_tempo_change> &map, double time)
+{
+    auto it = std::upper_bound(
+        map.begin() + 1, map.end(), time,
+        [](double time, const fmidi_tempo_change &tc) { return time < tc.time; });
+    return *(it - 1);
+}
+
+void fmidi_parallel_for(unsigned count, const std::function<void(unsigned)> &fn)
+{
+    std::atomic<unsigned> next(0);
+    auto work = [&fn, &next, count]() {
+        for (unsigned i; (i = next++) < count;)
+            fn(i);
+    };
+
+    unsigned nthreads = std::min(std::thread::hardware_concurrency(), count);
+    std::vector<std::thread> threads;
+    threads.reserve(nthreads);
+    try {
+        for (unsigned i = 1; i < nthreads; ++i)
+            threads.emplace_back(work);
+    }
+    catch (std::system_error &) {
+        // go on with the threads which could start
+    }
+    work();
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+uint32_t fmidi_event_category(const fmidi_event_t *evt)
+{
+    switch (evt->type) {
+    case fmidi_event_meta: {
+        unsigned tag = evt->data[0];
+        return (tag >= 0x01 && tag <= 0x0f) ?
+            fmidi_filter_text : fmidi_filter_meta;
+    }
+    case fmidi_event_message:
+        switch (evt->data[0] >> 4) {
+        case 0x8: case 0x9: return fmidi_filter_notes;
+        case 0xa: case 0xd: return fmidi_filter_pressure;
+        case 0xb: return fmidi_filter_controls;
+        case 0xc: return fmidi_filter_programs;
+        case 0xe: return fmidi_filter_pitch_bend;
+        default: return fmidi_filter_sysex;
+        }
+    case fmidi_event_escape:
+        return fmidi_filter_sysex;
+    case fmidi_event_xmi_timbre:
+    case fmidi_event_xmi_branch_point:
+        return fmidi_filter_xmi;
+    }
+    return 0;
+}
+
+static bool fmidi_event_discarded(const fmidi_event_t *evt)
+{
+    const fmidi_read_options_t &opts = fmidi_read_opts;
+
+    if (evt->type == fmidi_event_meta) {
+        unsigned tag = evt->data[0];
+        if (tag == 0x2f || tag == 0x51 || tag == 0x54)
+            return false;
+    }
+
+    if (opts.filter & fmidi_event_category(evt))
+        return true;
+    if (opts.filter_fn && !opts.filter_fn(evt, opts.filter_data))
+        return true;
+    return false;
+}
+
+void fmidi_event_filter(std::vector<uint8_t> &buf, size_t offset, uint32_t *carry)
+{
+    const fmidi_read_options_t &opts = fmidi_read_opts;
+    if (!opts.filter && !opts.filter_fn)
+        return;
+
+    size_t in = offset, out = offset, end = buf.size();
+    while (in < end) {
+        fmidi_event_t *evt = (fmidi_event_t *)&buf[in];
+        size_t size = fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
+        if (evt->delta <= UINT32_MAX - *carry && fmidi_event_discarded(evt))
+            *carry += evt->delta;
+        else {
+            uint64_t delta = (uint64_t)evt->delta + *carry;
+            evt->delta = (delta < UINT32_MAX) ? (uint32_t)delta : UINT32_MAX;
+            *carry = 0;
+            if (out != in)
+                memmove(&buf[out], &buf[in], size);
+            out += size;
+        }
+        in += size;
+    }
+    buf.resize(out);
+}
+
+//------------------------------------------------------------------------------
+void fmidi_track_store(fmidi_raw_track &trk, const std::vector<uint8_t> &buf)
+{
+    uint32_t limit = fmidi_read_opts.outline_limit;
+    fmidi_intern_pool_t *pool = fmidi_read_opts.intern_pool;
+    std::vector<uint8_t> evbuf;
+    std::vector<uint8_t> outbuf;
+    const std::vector<uint8_t> *inbuf = &buf;
+    std::shared_ptr<const void> interned;
+
+    if (limit) {
+        size_t in = 0, end = buf.size();
+        evbuf.reserve(end);
+        while (in < end) {
+            const fmidi_event_t *evt = (const fmidi_event_t *)&buf[in];
+            size_t size = fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
+            if (evt->datalen <= limit)
+                evbuf.insert(evbuf.end(), &buf[in], &buf[in] + size);
+            else if (pool) {
+                const fmidi_event_t *shared = fmidi_intern_event(pool, evt, interned);
+                fmidi_event_t *ref = fmidi_event_alloc(evbuf, sizeof(shared));
+                ref->type = (fmidi_event_type_t)fmidi_event_interned;
+                ref->delta = evt->delta;
+                ref->datalen = sizeof(shared);
+                memcpy(ref->data, &shared, sizeof(shared));
+            }
+            else {
+                uint32_t offset = outbuf.size();
+                outbuf.insert(outbuf.end(), &buf[in], &buf[in] + size);
+                fmidi_event_t *ref = fmidi_event_alloc(evbuf, 4);
+                ref->type = (fmidi_event_type_t)fmidi_event_outline;
+                ref->delta = evt->delta;
+                ref->datalen = 4;
+                memcpy(ref->data, &offset, 4);
+            }
+            in += size;
+        }
+        if (evbuf.size() != buf.size())
+            inbuf = &evbuf;
+    }
+    trk.interned = std::move(interned);
+
+    uint32_t evdatalen = trk.length = inbuf->size();
+    uint8_t *evdata = new uint8_t[evdatalen];
+    trk.data.reset(evdata, std::default_delete<uint8_t[]>());
+    memcpy(evdata, inbuf->data(), evdatalen);
+
+    uint32_t outdatalen = trk.payloadlength = outbuf.size();
+    if (outdatalen == 0)
+        trk.payload.reset();
+    else {
+        uint8_t *outdata = new uint8_t[outdatalen];
+        trk.payload.reset(outdata, std::default_delete<uint8_t[]>());
+        memcpy(outdata, outbuf.data(), outdatalen);
+    }
+
+    trk.exclusive = !trk.interned;
+}
+
+void fmidi_track_copy(const fmidi_raw_track &src, fmidi_raw_track &dst)
+{
+    std::vector<uint8_t> evbuf;
+    std::vector<uint8_t> outbuf;
+    evbuf.reserve(src.length);
+    outbuf.reserve(src.payloadlength);
+
+    // events stored apart are kept apart, interned ones are copied
+    const uint8_t *data = src.data.get();
+    for (uint32_t offset = 0; offset < src.length;) {
+        const fmidi_event_t *evt = (const fmidi_event_t *)&data[offset];
+        size_t size = fmidi_event_pad(fmidi_event_sizeof(evt->datalen));
+        const fmidi_event_t *target = fmidi_track_resolve(src, evt);
+        if (target == evt)
+            evbuf.insert(evbuf.end(), &data[offset], &data[offset] + size);
+        else {
+            uint32_t targetoffset = outbuf.size();
+            const uint8_t *targetdata = (const uint8_t *)target;
+            outbuf.insert(
+                outbuf.end(), targetdata,
+                targetdata + fmidi_event_pad(fmidi_event_sizeof(target->datalen)));
+            fmidi_event_t *ref = fmidi_event_alloc(evbuf, 4);
+            ref->type = (fmidi_event_type_t)fmidi_event_outline;
+            ref->delta = evt->delta;
+            ref->datalen = 4;
+            memcpy(ref->data, &targetoffset, 4);
+        }
+        offset += size;
+    }
+
+    fmidi_raw_track trk;
+    uint32_t evdatalen = trk.length = evbuf.size();
+    uint8_t *evdata = new uint8_t[evdatalen];
+    trk.data.reset(evdata, std::default_delete<uint8_t[]>());
+    memcpy(evdata, evbuf.data(), evdatalen);
+
+    uint32_t outdatalen = trk.payloadlength = outbuf.size();
+    if (outdatalen != 0) {
+        uint8_t *outdata = new uint8_t[outdatalen];
+        trk.payload.reset(outdata, std::default_delete<uint8_t[]>());
+        memcpy(outdata, outbuf.data(), outdatalen);
+    }
+
+    trk.source = src.source;
+    trk.sourcelength = src.sourcelength;
+    trk.exclusive = true;
+    dst = std::move(trk);
+}
+
 //------------------------------------------------------------------------------
 class fmidi_category_t : public std::error_category {
 public:
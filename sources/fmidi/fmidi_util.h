@@ -4,16 +4,50 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include "fmidi/fmidi.h"
+#include <functional>
+#include <memory>
 #include <vector>
+#include <string.h>
 
 struct fmidi_raw_track {
-    std::unique_ptr<uint8_t[]> data;
+    // owned, or aliased into a storage which is kept alive (see image)
+    std::shared_ptr<uint8_t> data;
     uint32_t length;
+    // encoded body of the chunk, present if retained and not modified since
+    std::shared_ptr<const uint8_t> source;
+    uint32_t sourcelength = 0;
+    // events with large data, stored apart and referred to from the track
+    std::shared_ptr<uint8_t> payload;
+    uint32_t payloadlength = 0;
+    // storage of the interned events the track refers to, if any
+    std::shared_ptr<const void> interned;
+    // whether the data and the payload belong to this track only, and may
+    // be modified in place
+    bool exclusive = false;
+};
+
+// internal types of references to events stored apart. the data of the
+// reference holds the position of the event in the payload of the track,
+// or the address of the event in an interning pool. the values are kept
+// within the range of `fmidi_event_type_t`, so they can be held by its
+// enumeration.
+enum { fmidi_event_outline = 0, fmidi_event_interned = 7 };
+
+struct fmidi_track_index {
+    std::vector<uint32_t> offset;  // position of each event in the track
+    std::vector<uint64_t> tick;  // absolute time of each event
 };
 
 struct fmidi_smf {
     fmidi_smf_info_t info;
     std::unique_ptr<fmidi_raw_track[]> track;
+    std::unique_ptr<fmidi_track_index[]> index;  // optional
+};
+
+struct fmidi_tempo_change {
+    uint64_t tick;
+    double time;  // since the start
+    uint32_t tempo;
 };
 
 //------------------------------------------------------------------------------
@@ -21,9 +55,64 @@ uintptr_t fmidi_event_pad(uintptr_t size);
 fmidi_event_t *fmidi_event_alloc(std::vector<uint8_t> &buf, uint32_t datalen);
 unsigned fmidi_message_sizeof(uint8_t id);
 
+// build the map of tempo changes of a range of tracks, which starts with the
+// default tempo. at equal ticks, the change of the higher track applies last.
+void fmidi_tempo_map_build(
+    const fmidi_smf_t *smf, unsigned first, unsigned count,
+    std::vector<fmidi_tempo_change> &map);
+// the change in effect at the tick or the time
+const fmidi_tempo_change &fmidi_tempo_at_tick(
+    const std::vector<fmidi_tempo_change> &map, double tick);
+const fmidi_tempo_change &fmidi_tempo_at_time(
+    const std::vector<fmidi_tempo_change> &map, double time);
+
+// position and time of each event of the track
+void fmidi_track_index_build(fmidi_track_index &idx, const fmidi_raw_track &trk);
+
+// call the function for each number below the count, over several threads
+void fmidi_parallel_for(unsigned count, const std::function<void(unsigned)> &fn);
+
+// category of the event, as one of the filter flags
+uint32_t fmidi_event_category(const fmidi_event_t *evt);
+
+// apply the filter of the read options to the events of the buffer which
+// start at `offset`. the delta of discarded events accumulates in `carry`.
+void fmidi_event_filter(std::vector<uint8_t> &buf, size_t offset, uint32_t *carry);
+
+// set the events of the track from the buffer, storing apart the events
+// larger than the limit of the read options
+void fmidi_track_store(fmidi_raw_track &trk, const std::vector<uint8_t> &buf);
+// copy the events of the track into storage of its own
+void fmidi_track_copy(const fmidi_raw_track &src, fmidi_raw_track &dst);
+// the shared copy of the event in the pool, which `owner` keeps alive
+const fmidi_event_t *fmidi_intern_event(
+    fmidi_intern_pool_t *pool, const fmidi_event_t *evt, std::shared_ptr<const void> &owner);
+// the event which the track stores at this position, following references
+const fmidi_event_t *fmidi_track_resolve(
+    const fmidi_raw_track &trk, const fmidi_event_t *evt);
+
 //------------------------------------------------------------------------------
 inline uintptr_t fmidi_event_pad(uintptr_t size)
 {
     uintptr_t nb = size % alignof(fmidi_event_t);
     return nb ? (size + alignof(fmidi_event_t) - nb) : size;
 }
+
+inline const fmidi_event_t *fmidi_track_resolve(
+    const fmidi_raw_track &trk, const fmidi_event_t *evt)
+{
+    switch ((int)evt->type) {
+    case fmidi_event_outline: {
+        uint32_t offset;
+        memcpy(&offset, evt->data, 4);
+        return (const fmidi_event_t *)&trk.payload.get()[offset];
+    }
+    case fmidi_event_interned: {
+        const fmidi_event_t *shared;
+        memcpy(&shared, evt->data, sizeof(shared));
+        return shared;
+    }
+    default:
+        return evt;
+    }
+}